@@ -11,6 +11,7 @@
 #include "f32_file.h"
 #include "f32_access.h"
 #include "f32_print.h"
+#include "rtc.h"
 void f32_ls(uint32_t dir_cluster);
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
@@ -25,6 +26,14 @@ void f32_ls(uint32_t dir_cluster);
 
 #define FAT32_ENTRY_SIZE    4 /* size of a FAT32 entry in bytes */
 
+/**
+ * FSInfo definitions
+ */
+#define FSI_LEAD_SIG        0x41615252
+#define FSI_STRUC_SIG       0x61417272
+#define FSI_TRAIL_SIG       0xAA550000
+#define FSI_UNKNOWN         0xFFFFFFFF
+
 /**
  * Partition table. Appears as the very first entry in a formatted sd card
  */
@@ -83,6 +92,11 @@ typedef struct {
     uint16_t fat_start;
     uint16_t data_start_sec;
     uint32_t fat_size; /* size of FAT in sectors */
+    uint32_t cluster_count; /* number of the last data cluster + 1 */
+    uint32_t fsinfo_sec; /* FSInfo sector, 0 if the volume has none */
+    uint32_t free_count; /* free clusters, FSI_UNKNOWN until counted */
+    uint32_t next_free; /* cluster to start the next free search from */
+    uint8_t fsinfo_dirty;
 } __attribute__((packed)) f32_sys;
 
 typedef struct {
@@ -97,6 +111,110 @@ typedef struct {
 
 f32_sys * fs;
 f32_sector * buf;
+#if !F32_NO_RTC
+extern RTC rtc;
+#endif
+
+/**
+ * FAT window. Keeps the most recently used FAT sector resident so cluster
+ * chain walks don't reload it through the data buffer on every hop. The
+ * FSInfo sector is read and updated through it as well. Without a
+ * dedicated window the FAT sector lives in the shared buffer and stays
+ * resident until the buffer is taken for anything else.
+ */
+#if F32_FAT_WINDOW
+static f32_sector fat_win;
+#define fat_buf (&fat_win)
+#else
+#define fat_buf buf
+#endif
+static uint32_t fat_win_sec; /* FAT sector held in the window, 0 if none */
+static uint8_t fat_win_dirty;
+
+/**
+ * Directory sector f32_readdir left in the shared buffer, 0 if the buffer
+ * has been used for something else since. Every other entry point may
+ * reuse the buffer and forgets it.
+ */
+static uint32_t buf_dir_sector;
+#if F32_FAT_WINDOW
+#define f32_buf_taken()     (buf_dir_sector = 0)
+#else
+#define f32_buf_taken()     (buf_dir_sector = 0, fat_win_sec = 0, fat_win_dirty = 0)
+#endif
+
+/**
+ * Read a sector other than a FAT sector into the shared buffer
+ */
+static inline uint8_t f32_buf_read(uint32_t sector) {
+    f32_buf_taken();
+    return io_read_block(sector, buf->data);
+}
+
+/**
+ * Directory index. Hashes every short name of one large directory to its
+ * entry number, so finding a name or a free entry reads a single directory
+ * sector. Slots use open addressing with pos 0 marking an empty slot.
+ */
+#if F32_DIR_INDEX
+#define F32_DIR_INDEX_SLOTS     (F32_DIR_INDEX/4)
+#define F32_DIR_INDEX_UNKNOWN   0xFFFF
+
+typedef struct {
+    uint16_t hash;
+    uint16_t pos; /* entry number + 1, 0 if the slot is empty */
+} f32_index_slot;
+
+static struct {
+    uint32_t dir_cluster; /* indexed directory, 0 if none */
+    uint16_t count; /* names in the index */
+    uint16_t free_pos; /* entry for the next created file */
+    uint16_t end_pos; /* entry holding the end marker */
+    uint16_t capacity; /* entries the directory's clusters hold */
+    f32_index_slot slots[F32_DIR_INDEX_SLOTS];
+} dir_index;
+
+static uint32_t index_overflow; /* directory with more names than the index holds, 0 if none */
+static uint32_t index_candidate; /* directory waiting to replace the indexed one */
+static uint8_t index_scans; /* expensive scans of the candidate so far */
+#endif
+
+/**
+ * Name lookup cache. Maps a name in a directory to what f32_find_file
+ * would find there. Entries mirror the directory entry on the card, so
+ * they are updated whenever an entry is written and an entry_sector of 0
+ * records a name that doesn't exist.
+ */
+#if F32_NAME_CACHE
+typedef struct {
+    uint32_t dir_cluster;
+    char name[11];
+    uint8_t used;
+    uint32_t start_cluster;
+    uint32_t size;
+    uint32_t entry_sector;
+    uint16_t entry_offset;
+} f32_name_entry;
+
+static f32_name_entry name_cache[F32_NAME_CACHE];
+static uint8_t name_next; /* next entry to replace */
+#endif
+
+/**
+ * Path prefix cache. Maps the directory part of a path, without the
+ * leading slash, to the directory's first cluster. Directories are never
+ * moved or removed, so entries stay valid until the next mount.
+ */
+#if F32_PATH_CACHE
+typedef struct {
+    char path[F32_PATH_CACHE_LEN];
+    uint8_t len; /* 0 if unused */
+    uint32_t cluster;
+} f32_path_entry;
+
+static f32_path_entry path_cache[F32_PATH_CACHE];
+static uint8_t path_next; /* next entry to replace */
+#endif
 
 /** Module definitions */
 static uint32_t f32_get_next_cluster(uint32_t current_cluster);
@@ -104,15 +222,56 @@ static uint32_t f32_cluster_to_sector(uint32_t cluster);
 static uint32_t f32_sector_to_cluster(uint32_t sector);
 static uint8_t f32_find_file(uint32_t dir_cluster, const char * fname, const char * ext, f32_file * fd);
 static uint8_t f32_check_file(const char * fname, const char * ext, const DIR_Entry * en);
+#if F32_DIR_INDEX
+static uint8_t f32_index_find(const char * fname, const char * ext, f32_file * fd);
+static void f32_index_build(uint32_t dir_cluster);
+static uint8_t f32_index_free(uint32_t * sector, uint16_t * offset);
+static void f32_index_created(uint32_t dir_cluster, const char * short_name, uint8_t entries);
+#endif
 
 static uint32_t f32_find_free(void);
 static uint8_t f32_dir_entry_empty(const DIR_Entry * en);
-static uint8_t f32_find_empty_entry(uint32_t dir_cluster, uint32_t * sector_offset, uint16_t * dir_offset);
+static uint8_t f32_find_empty_entry(uint32_t dir_cluster, uint8_t count, uint32_t * sector_offset, uint16_t * dir_offset);
 static uint8_t f32_point_cluster(uint32_t current_cluster, uint32_t free_cluster);
 static uint32_t f32_count_free(void);
+static uint8_t f32_fat_load(uint32_t sec);
+static uint8_t f32_fat_flush(void);
+static uint8_t f32_fat_modified(void);
+static uint8_t f32_fsinfo_load(void);
+static uint8_t f32_fsinfo_flush(void);
+static uint8_t f32_mark_dirty(f32_file * fd, uint32_t bytes);
+static f32_extent * f32_extent_last(f32_file * fd);
+static void f32_extent_note(f32_file * fd, uint32_t cluster, uint32_t next_cluster);
+static uint8_t f32_next_file_cluster(f32_file * fd, uint8_t allocate);
+static uint32_t f32_find_free_run(uint32_t cluster, uint32_t count);
+#if F32_LFN
+static uint8_t f32_find_long_file(uint32_t dir_cluster, const char * name, uint8_t len, f32_file * fd);
+static uint8_t f32_short_alias(uint32_t dir_cluster, const char * name, uint8_t len, char * short_name, f32_file * fd);
+static uint8_t f32_create_long_name(const char * name, uint8_t len, const char * short_name, uint32_t * sector, uint16_t * offset);
+#endif
+static void f32_file_at(f32_file * fd, uint32_t start_cluster, uint32_t size, uint32_t entry_sector, uint16_t entry_offset);
+#if F32_NAME_CACHE
+static f32_name_entry * f32_name_lookup(uint32_t dir_cluster, const char * fname, const char * ext);
+static void f32_name_store(uint32_t dir_cluster, const char * fname, const char * ext, const f32_file * fd);
+static void f32_name_update(const f32_file * fd);
+#endif
+#if F32_PATH_CACHE
+static uint8_t f32_path_lookup(const char * path, uint8_t len, uint32_t * cluster);
+static void f32_path_store(const char * path, uint8_t len, uint32_t cluster);
+#endif
+#if F32_HANDLE_BUFFERS
+static uint8_t f32_handle_flush(f32_file * fd);
+static void f32_handle_drop(f32_file * fd, uint32_t sector, uint16_t count);
+#endif
 
 uint8_t f32_mount(f32_sector * sec) {
-    if(io_init()) {
+    return f32_mount_dev(&IO_DEFAULT_DEVICE, sec);
+}
+
+uint8_t f32_mount_dev(const io_device * dev, f32_sector * sec) {
+    f32_buf_taken();
+
+    if(io_init(dev)) {
         return 1;
     }
 
@@ -121,7 +280,7 @@ uint8_t f32_mount(f32_sector * sec) {
     fs = malloc(sizeof(f32_sys));
 
     /** Read boot parameter block */
-    if(io_read_block(boot_sector, buf->data)) {
+    if(f32_buf_read(boot_sector)) {
         return 1;
     }
 
@@ -143,7 +302,7 @@ uint8_t f32_mount(f32_sector * sec) {
 
         if(i == 4) return 1;
 
-        if(io_read_block(boot_sector, buf->data)) {
+        if(f32_buf_read(boot_sector)) {
             return 1;
         }
 
@@ -153,12 +312,37 @@ uint8_t f32_mount(f32_sector * sec) {
     }
 
     BootParameterBlock * bs = (BootParameterBlock*)buf->data;
+    uint32_t sectors = io_sector_count();
+    if(sectors && (boot_sector + bs->BPB_TotSec32 > sectors)) {
+        return 1;
+    }
+
     fs->sec_per_cluster = bs->BPB_SecPerClus,
     fs->fat_start = boot_sector + bs->BPB_RsvdSecCnt,
     fs->data_start_sec = boot_sector + bs->BPB_RsvdSecCnt + bs->BPB_FATSz32*bs->BPB_NumFATs;
     fs->fat_size = bs->BPB_FATSz32;
+    fs->cluster_count = (bs->BPB_TotSec32 - (fs->data_start_sec - boot_sector))/fs->sec_per_cluster + 2;
+    fs->fsinfo_sec = bs->BPB_FSInfo ? boot_sector + bs->BPB_FSInfo : 0;
+    io_stats_layout(fs->fat_start, fs->data_start_sec);
+
+    fat_win_sec = 0;
+    fat_win_dirty = 0;
+#if F32_NAME_CACHE
+    memset(name_cache, 0, sizeof(name_cache));
+#endif
+#if F32_PATH_CACHE
+    memset(path_cache, 0, sizeof(path_cache));
+#endif
+#if F32_DIR_INDEX
+    dir_index.dir_cluster = 0;
+    index_overflow = 0;
+    index_candidate = 0;
+#endif
+    if(f32_fsinfo_load()) {
+        return 1;
+    }
 
-    if(io_read_block(fs->fat_start, buf->data)) {
+    if(f32_fat_load(fs->fat_start)) {
         return 1;
     }
 
@@ -166,31 +350,126 @@ uint8_t f32_mount(f32_sector * sec) {
 }
 
 uint8_t f32_close(f32_file * fd) {
+    f32_buf_taken();
+
     if(fd != NULL) {
+        uint8_t res = f32_sync(fd);
         free(fd);
+        return res;
+    }
+
+    if(f32_fat_flush()) {
+        return 1;
+    }
+
+    return io_flush();
+}
+
+uint8_t f32_sync(f32_file * fd) {
+    f32_buf_taken();
+
+#if F32_HANDLE_BUFFERS
+    if(f32_handle_flush(fd)) {
+        return 1;
+    }
+#endif
+
+    if(fd->flags & F32_FILE_DIRTY) {
+        // the FAT has to describe the new clusters before the size does
+        if(f32_fat_flush() || f32_update_file(fd)) {
+            return 1;
+        }
+        f32_buf_taken();
+#if F32_NAME_CACHE
+        f32_name_update(fd);
+#endif
+
+        fd->flags &= ~F32_FILE_DIRTY;
+        fd->unsynced_bytes = 0;
+    }
+
+    if(f32_fsinfo_flush() || f32_fat_flush() || io_flush()) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline uint32_t f32_time_of_day(void) {
+#if F32_NO_RTC
+    return 0;
+#else
+    return (uint32_t)rtc.hour*3600 + (uint16_t)rtc.min*60 + rtc.sec;
+#endif
+}
+
+/**
+ * Record that the directory entry of fd is out of date and sync it once
+ * the unsynced bytes or their age exceed the configured limits
+ */
+static uint8_t f32_mark_dirty(f32_file * fd, uint32_t bytes) {
+    if(!(fd->flags & F32_FILE_DIRTY)) {
+        fd->flags |= F32_FILE_DIRTY;
+        fd->dirty_time = f32_time_of_day();
+    }
+
+    fd->unsynced_bytes += bytes;
+
+#if F32_SYNC_BYTES
+    if(fd->unsynced_bytes >= F32_SYNC_BYTES) {
+        return f32_sync(fd);
+    }
+#endif
+
+#if F32_SYNC_SECONDS && !F32_NO_RTC
+    // time of day wraps around at midnight
+    if((f32_time_of_day() + 86400UL - fd->dirty_time) % 86400UL >= F32_SYNC_SECONDS) {
+        return f32_sync(fd);
     }
+#endif
 
     return 0;
 }
 
 uint8_t f32_umount() {
+    f32_buf_taken();
+
+    if(f32_fsinfo_flush() || f32_fat_flush() || io_flush()) {
+        return 1;
+    }
+
     free(fs);
     return 0;
 }
 
+uint8_t f32_poll(void) {
+    return io_poll();
+}
+
 uint16_t f32_read(f32_file * fd) {
+    f32_buf_taken();
+
     while(fd->file_offset < fd->size) {
         if(fd->sector_count >= fs->sec_per_cluster) {
-            fd->sector_count = 0;
-            uint32_t next_cluster = f32_get_next_cluster(fd->current_cluster);
-            if(F32_CLUSTER_IS_EOF(next_cluster)) {
+            if(f32_next_file_cluster(fd, 0)) {
                 // should not get to this point if file size is correct
                 return F32_EOF;
             }
-            fd->current_cluster = next_cluster;
         }
 
-        if(io_read_block(f32_cluster_to_sector(fd->current_cluster) + fd->sector_count, buf->data)) {
+        uint32_t sector = f32_cluster_to_sector(fd->current_cluster) + fd->sector_count;
+
+        // the rest of the cluster is contiguous, fetch it in one go
+        uint32_t run = MIN((uint32_t)(fs->sec_per_cluster - fd->sector_count), (fd->size - fd->file_offset + SEC_SIZE - 1) >> 9);
+        io_read_ahead(sector, run);
+
+        f32_buf_taken();
+#if F32_HANDLE_BUFFERS
+        if(sector == fd->buffered_sector) {
+            memcpy(buf->data, fd->sec.data, SEC_SIZE);
+        } else
+#endif
+        if(io_read_stream(sector, run, buf->data)) {
             return 0;
         }
 
@@ -206,31 +485,57 @@ uint16_t f32_read(f32_file * fd) {
     return F32_EOF;
 }
 
-static void f32_extract_folder(const char * start, const char * end, char * folder) {
-    size_t n = (size_t)end - (size_t)start;
-    memcpy(folder, start, MIN(11, n));
-    if(n < 11) {
-        memset(&folder[n], 0x20, 11-n);
+/**
+ * Convert a path component to a padded 8.3 name
+ *
+ * @return 0 on success, 1 if the component doesn't fit 8.3
+ */
+static uint8_t f32_short_name(const char * name, size_t len, char * short_name) {
+    memset(short_name, 0x20, 11);
+
+    const char * dot = memchr(name, '.', len);
+    size_t base = (dot != NULL) ? (size_t)(dot - name) : len;
+    size_t ext = (dot != NULL) ? len - base - 1 : 0;
+    if((base == 0) || (base > 8) || (ext > 3) || ((dot != NULL) && ((ext == 0) || memchr(dot + 1, '.', ext)))) {
+        return 1;
     }
+
+    memcpy(short_name, name, base);
+    memcpy(&short_name[8], dot + 1, ext);
+    return 0;
 }
 
-static void f32_extract_file(const char * start, const char * end, char * dir_name) {
-    size_t n = (size_t)end - (size_t)start;
-    memcpy(dir_name, start, MIN(n, 8));
-    if(n < 8) {
-        memset(&dir_name[n], 0x20, 8 - n);
+/**
+ * Look up a path component of the given length in a directory, by its
+ * long name if it doesn't fit 8.3
+ */
+static uint8_t f32_find_component(uint32_t dir_cluster, const char * name, size_t len, f32_file * fd) {
+    char short_name[11];
+    if(!f32_short_name(name, len, short_name)) {
+        return f32_find_file(dir_cluster, short_name, &short_name[8], fd);
+    }
+
+    // the entries every subdirectory starts with, never created
+    if(((len == 1) || (len == 2)) && (memcmp(name, "..", len) == 0)) {
+        memcpy(short_name, name, len);
+        return f32_find_file(dir_cluster, short_name, &short_name[8], fd);
     }
-}
 
-static void f32_extract_ext(const char * start, const char * end, char * ext) {
-    memcpy(&ext[8], end+1, 3);
+#if F32_LFN
+    if((len > 0) && (len <= LFN_MAX)) {
+        return f32_find_long_file(dir_cluster, name, len, fd);
+    }
+#endif
+
+    return 0;
 }
 
 f32_file * f32_open(
         const char * __restrict__ fname, 
         const char * __restrict__ modes) 
 {
-    char dir_name[11] = {0};
+    f32_buf_taken();
+
     const char * pStart;
     const char * pEnd;
 
@@ -245,12 +550,28 @@ f32_file * f32_open(
 
     // allocate space for the potential file
     f32_file * fd = malloc(sizeof(f32_file));
+#if F32_HANDLE_BUFFERS
+    fd->buffered_sector = 0;
+#endif
 
     uint32_t cluster = f32_sector_to_cluster(fs->data_start_sec);
-    while(pEnd != NULL) {
-        f32_extract_folder(pStart, pEnd, dir_name);
 
-        if(!f32_find_file(cluster, dir_name, &dir_name[8], fd)) {
+#if F32_PATH_CACHE
+    // start from the deepest directory already resolved
+    const char * path = pStart;
+    const char * dir_end = strrchr(path, '/');
+    size_t dir_len = (dir_end != NULL) ? (size_t)(dir_end - path) : 0;
+    if((dir_len > 0) && (dir_len <= F32_PATH_CACHE_LEN)) {
+        uint8_t known = f32_path_lookup(path, dir_len, &cluster);
+        if(known) {
+            pStart = &path[known + 1];
+            pEnd = strchr(pStart, '/');
+        }
+    }
+#endif
+
+    while(pEnd != NULL) {
+        if(!f32_find_component(cluster, pStart, pEnd - pStart, fd)) {
             free(fd);
             return NULL;
         }
@@ -260,30 +581,56 @@ f32_file * f32_open(
         pEnd = strchr(pStart, '/');
     }
 
-    // check if filename/extension exists in entry
-    pEnd = strchr(pStart, '.');
-    if(pEnd == NULL) {
-        free(fd);
-        return NULL;
+#if F32_PATH_CACHE
+    if((dir_len > 0) && (dir_len <= F32_PATH_CACHE_LEN)) {
+        f32_path_store(path, dir_len, cluster);
     }
+#endif
 
-    f32_extract_file(pStart, pEnd, dir_name);
-    f32_extract_ext(pStart, pEnd, dir_name);
-
-    if(!f32_find_file(cluster, dir_name, &dir_name[8], fd)) {
+    size_t len = strlen(pStart);
+    if(!f32_find_component(cluster, pStart, len, fd)) {
         if((modes[0] == 'w') || (modes[0] == 'a')) {
             // create file
+            char dir_name[11];
+            uint8_t entries = 1;
+            if(f32_short_name(pStart, len, dir_name)) {
+#if F32_LFN
+                if((len > LFN_MAX) || f32_short_alias(cluster, pStart, len, dir_name, fd)) {
+                    free(fd);
+                    return NULL;
+                }
+                entries += (len + LFN_CHARS - 1)/LFN_CHARS;
+#else
+                free(fd);
+                return NULL;
+#endif
+            }
+
             uint32_t sector_offset;
             uint16_t dir_offset;
-            if(f32_find_empty_entry(cluster, &sector_offset, &dir_offset)) {
+            if(f32_find_empty_entry(cluster, entries, &sector_offset, &dir_offset)) {
+                free(fd);
+                return NULL;
+            }
+
+#if F32_LFN
+            if((entries > 1) && f32_create_long_name(pStart, len, dir_name, &sector_offset, &dir_offset)) {
                 free(fd);
                 return NULL;
             }
+#endif
 
             if(f32_create_file(fd, dir_name, sector_offset, dir_offset)) {
                 free(fd);
                 return NULL;
             }
+            f32_buf_taken();
+#if F32_NAME_CACHE
+            f32_name_store(cluster, dir_name, &dir_name[8], fd);
+#endif
+#if F32_DIR_INDEX
+            f32_index_created(cluster, dir_name, entries);
+#endif
 
             return fd;
 
@@ -306,28 +653,186 @@ f32_file * f32_open(
     return fd;
 }
 
+uint8_t f32_opendir(f32_dir * dir, const char * path) {
+    f32_buf_taken();
+
+    const uint32_t root = f32_sector_to_cluster(fs->data_start_sec);
+    uint32_t cluster = root;
+    const char * pStart = (path[0] == '/') ? &path[1] : path;
+    if(*pStart != 0) {
+        f32_file * fd = malloc(sizeof(f32_file));
+        if(fd == NULL) {
+            return 1;
+        }
+
+        while(*pStart != 0) {
+            const char * pEnd = strchr(pStart, '/');
+            if(pEnd == NULL) {
+                pEnd = &pStart[strlen(pStart)];
+            }
+
+            if(!f32_find_component(cluster, pStart, pEnd - pStart, fd)) {
+                free(fd);
+                return 1;
+            }
+
+            // ".." entries of top level directories point at cluster 0
+            cluster = fd->start_cluster ? fd->start_cluster : root;
+            pStart = (*pEnd == '/') ? pEnd + 1 : pEnd;
+        }
+
+        // the last component has to be a directory
+        io_stats_next(F32_CLASS_DIR);
+        uint8_t res = f32_buf_read(fd->file_entry_sector) ||
+            !(((const DIR_Entry*)&buf->data[fd->file_entry_offset])->DIR_Attr & ATTR_DIRECTORY);
+        free(fd);
+        if(res) {
+            return 1;
+        }
+    }
+
+    f32_opendir_cluster(dir, cluster);
+    return 0;
+}
+
+void f32_opendir_cluster(f32_dir * dir, uint32_t dir_cluster) {
+    dir->cluster = dir_cluster ? dir_cluster : f32_sector_to_cluster(fs->data_start_sec);
+    dir->index = 0;
+}
+
+/**
+ * Format a padded 8.3 name as NAME.EXT
+ */
+static void f32_dirent_name(const uint8_t * short_name, char * name) {
+    uint8_t n = 0;
+    for(uint8_t i = 0; (i < 8) && (short_name[i] != 0x20); i++) {
+        name[n++] = short_name[i];
+    }
+
+    // a name starting with 0xE5 is stored with 0x05
+    if(name[0] == 0x05) {
+        name[0] = 0xE5;
+    }
+
+    if(short_name[8] != 0x20) {
+        name[n++] = '.';
+        for(uint8_t i = 8; (i < 11) && (short_name[i] != 0x20); i++) {
+            name[n++] = short_name[i];
+        }
+    }
+
+    name[n] = 0;
+}
+
+uint8_t f32_readdir(f32_dir * dir, f32_dirent * out) {
+    const uint16_t entries = SEC_SIZE/sizeof(DIR_Entry);
+
+    while(!F32_CLUSTER_IS_EOF(dir->cluster)) {
+        if(dir->index >= fs->sec_per_cluster*entries) {
+            dir->cluster = f32_get_next_cluster(dir->cluster);
+            dir->index = 0;
+            continue;
+        }
+
+        // a sector is only read once unless the buffer was used in between
+        uint32_t sector = f32_cluster_to_sector(dir->cluster) + dir->index/entries;
+        if(sector != buf_dir_sector) {
+            io_stats_next(F32_CLASS_DIR);
+            if(f32_buf_read(sector)) {
+                buf_dir_sector = 0;
+                return 1;
+            }
+            buf_dir_sector = sector;
+        }
+
+        const DIR_Entry * en = (const DIR_Entry*)&buf->data[(dir->index % entries)*sizeof(DIR_Entry)];
+
+        // all following entries are empty
+        if(en->DIR_Name[0] == 0x00) {
+            dir->cluster = F32_CLUSTER_EOF;
+            return 1;
+        }
+
+        dir->index++;
+        if((en->DIR_Name[0] == 0xE5) || (en->DIR_Attr == ATTR_LONG_NAME)) {
+            continue;
+        }
+
+        f32_dirent_name(en->DIR_Name, out->name);
+        out->attr = en->DIR_Attr;
+        out->size = en->DIR_FileSize;
+        out->cluster = ((uint32_t)en->DIR_FstClusHI << 16) | (en->DIR_FstClusLO);
+        out->crt_date = en->DIR_CrtDate;
+        out->crt_time = en->DIR_CrtTime;
+        out->wrt_date = en->DIR_WrtDate;
+        out->wrt_time = en->DIR_WrtTime;
+        return 0;
+    }
+
+    return 1;
+}
+
+void f32_ls(uint32_t dir_cluster) {
+    f32_dir dir;
+    f32_dirent en;
+
+    f32_opendir_cluster(&dir, dir_cluster);
+    while(f32_readdir(&dir, &en) == 0) {
+        if(en.attr & ATTR_VOLUME_ID) {
+            continue;
+        }
+
+        printf("%s%s\t%lu\t", en.name, (en.attr & ATTR_DIRECTORY) ? "/" : "", (unsigned long)en.size);
+        f32_print_date(en.wrt_date);
+        printf(" ");
+        f32_print_timestamp(en.wrt_time);
+    }
+}
+
+/**
+ * Find count consecutive free entries in a directory. Runs don't cross
+ * cluster boundaries, so their sectors are consecutive.
+ */
 static uint8_t f32_find_empty_entry(
         uint32_t dir_cluster,
+        uint8_t count,
         uint32_t * sector_offset,
         uint16_t * dir_offset)
 {
     uint32_t dir_sec;
 
+#if F32_DIR_INDEX
+    if((count == 1) && (dir_cluster == dir_index.dir_cluster)) {
+        if(f32_index_free(sector_offset, dir_offset) == 0) {
+            return 0;
+        }
+    }
+#endif
+
     while(!F32_CLUSTER_IS_EOF(dir_cluster)) {
         dir_sec = f32_cluster_to_sector(dir_cluster);
+        uint8_t run = 0;
 
         // iterate through every sector in the cluster
         for(uint32_t sec = 0; sec < fs->sec_per_cluster; sec++) {
-            io_read_block(dir_sec + sec, buf->data);
+            io_stats_next(F32_CLASS_DIR);
+            f32_buf_read(dir_sec + sec);
 
             // iterate through the entries in current sector
             for(uint16_t i = 0; i < SEC_SIZE/sizeof(DIR_Entry); i++) {
                 DIR_Entry * en = (DIR_Entry*)&buf->data[i*sizeof(DIR_Entry)];
 
-                // skip any empty entries
-                if(f32_dir_entry_empty(en)) {
+                if(!f32_dir_entry_empty(en)) {
+                    run = 0;
+                    continue;
+                }
+
+                if(run++ == 0) {
                     *dir_offset = i*sizeof(DIR_Entry);
                     *sector_offset = dir_sec + sec;
+                }
+
+                if(run == count) {
                     return 0;
                 }
             }
@@ -340,43 +845,41 @@ static uint8_t f32_find_empty_entry(
 }
 
 uint8_t f32_write_sec(f32_file * fd) {
+    f32_buf_taken();
+
     uint32_t curr_sector = f32_cluster_to_sector(fd->current_cluster) + fd->sector_count;
 
     uint16_t byte_offset = fd->file_offset & 0x1FF;
     fd->file_offset -= byte_offset; // reset to beginning of sector
 
+#if F32_HANDLE_BUFFERS
+    f32_handle_drop(fd, curr_sector, 1);
+#endif
     io_write_block(curr_sector, buf->data);
     fd->file_offset += SEC_SIZE;
     if(fd->file_offset > fd->size) {
         fd->size += SEC_SIZE - byte_offset;
 
         // update file attributes
-        f32_update_file(fd);
+        if(f32_mark_dirty(fd, SEC_SIZE - byte_offset)) {
+            return 1;
+        }
     }
 
     fd->sector_count++;
     if(fd->sector_count >= fs->sec_per_cluster) {
-        uint32_t next_cluster = f32_get_next_cluster(fd->current_cluster);
-        if(F32_CLUSTER_IS_EOF(next_cluster)) {
-            // allocate new cluster
-            uint32_t free_cluster = f32_allocate_free();
-            if(free_cluster == 0) {
-                // no clusters left!
-                return 1;
-            }
-
-            f32_point_cluster(fd->current_cluster, free_cluster);
-            next_cluster = free_cluster;
+        if(f32_next_file_cluster(fd, 1)) {
+            // no clusters left!
+            return 1;
         }
-
-        fd->current_cluster = next_cluster;
-        fd->sector_count = 0;
     }
 
     return 0;
 }
 
 uint8_t f32_write(f32_file * fd, const uint8_t * data, uint16_t num_bytes) {
+    f32_buf_taken();
+
     uint16_t copied_bytes = 0;
     while(copied_bytes < num_bytes) {
         uint16_t byte_offset = fd->file_offset & 0x1FF;
@@ -385,102 +888,359 @@ uint8_t f32_write(f32_file * fd, const uint8_t * data, uint16_t num_bytes) {
 
         uint32_t curr_sector = f32_cluster_to_sector(fd->current_cluster) + fd->sector_count;
 
-        if(remains >= chunk) {
-            fd->sector_count++; // move on to next sector
+        // whole sectors up to the end of the cluster
+        uint16_t run = MIN(remains >> 9, fs->sec_per_cluster - fd->sector_count);
+
+        if((byte_offset == 0) && (run > 1)) {
+            // send them straight from the caller's data in one transfer
+#if F32_HANDLE_BUFFERS
+            f32_handle_drop(fd, curr_sector, run);
+#endif
+            if(io_write_blocks(curr_sector, run, &data[copied_bytes])) {
+                return 1;
+            }
+
+            chunk = run << 9;
+            fd->sector_count += run;
         } else {
-            chunk = remains;
-        }
+            if(remains >= chunk) {
+                fd->sector_count++; // move on to next sector
+            } else {
+                chunk = remains;
+            }
 
-        if(io_read_block(curr_sector, buf->data)) {
-            while(1) {}
-            return 1;
-        }
+#if F32_HANDLE_BUFFERS
+            // the sector stays in the handle until the file moves on
+            if(curr_sector != fd->buffered_sector) {
+                if(f32_handle_flush(fd)) {
+                    return 1;
+                }
 
-        memcpy(&buf->data[byte_offset], &data[copied_bytes], chunk);
+                if((byte_offset == 0) && ((chunk == SEC_SIZE) || (fd->file_offset >= fd->size))) {
+                    memset(fd->sec.data, 0, SEC_SIZE);
+                } else if(io_read_block(curr_sector, fd->sec.data)) {
+                    return 1;
+                }
+                fd->buffered_sector = curr_sector;
+            }
 
-        if(io_write_block(curr_sector, buf->data)) {
-            while(1) {}
-            return 1;
+            memcpy(&fd->sec.data[byte_offset], &data[copied_bytes], chunk);
+            fd->flags |= F32_FILE_BUF_DIRTY;
+#else
+            f32_buf_taken();
+            if(chunk == SEC_SIZE) {
+                // whole sector is overwritten, nothing to read
+            } else if((byte_offset == 0) && (fd->file_offset >= fd->size)) {
+                // sector lies past the end of the file and holds no live data
+                memset(buf->data, 0, SEC_SIZE);
+            } else if(io_read_block(curr_sector, buf->data)) {
+                while(1) {}
+                return 1;
+            }
+
+            memcpy(&buf->data[byte_offset], &data[copied_bytes], chunk);
+
+            if(io_write_block(curr_sector, buf->data)) {
+                while(1) {}
+                return 1;
+            }
+#endif
         }
 
         copied_bytes += chunk;
         fd->file_offset += chunk;
         if(fd->file_offset > fd->size) {
-            fd->size += chunk;
+            fd->size = fd->file_offset;
         }
 
         if(fd->sector_count >= fs->sec_per_cluster) {
-            uint32_t next_cluster = f32_get_next_cluster(fd->current_cluster);
-            if(F32_CLUSTER_IS_EOF(next_cluster)) {
-                // allocate new cluster
-                uint32_t free_cluster = f32_allocate_free();
-                if(free_cluster == 0) {
-                    // no clusters left!
-                    return 1;
-                }
-
-                f32_point_cluster(fd->current_cluster, free_cluster);
-                next_cluster = free_cluster;
+            if(f32_next_file_cluster(fd, 1)) {
+                // no clusters left!
+                return 1;
             }
-
-            fd->current_cluster = next_cluster;
-            fd->sector_count = 0;
         }
     }
 
-    if(f32_update_file(fd)) {
-        return 1;
-    }
-
-    return 0;
+    return f32_mark_dirty(fd, num_bytes);
 }
 
 uint8_t f32_seek(f32_file * fd, uint32_t offset) {
+    f32_buf_taken();
+
     if(offset > fd->size) {
         return 1;
     }
 
-    fd->current_cluster = fd->start_cluster;
+    uint32_t cluster_bytes = (uint32_t)fs->sec_per_cluster << 9;
+    uint32_t target = offset / cluster_bytes;
+
+    // jump as far as the extent map reaches, then walk the FAT from there
+    f32_extent * ex = f32_extent_last(fd);
+    for(uint8_t i = 0; i < fd->extent_count; i++) {
+        if(target < fd->extents[i].file_cluster + fd->extents[i].length) {
+            ex = &fd->extents[i];
+            break;
+        }
+    }
+
+    uint32_t index = MIN(target, ex->file_cluster + ex->length - 1);
+    fd->current_cluster = ex->cluster + (index - ex->file_cluster);
     fd->sector_count = 0;
-    fd->file_offset = 0;
-    while(fd->file_offset != offset) {
-        // if we are in the correct cluster
-        if((offset - fd->file_offset) < (fs->sec_per_cluster<<9)) {
-            fd->sector_count = (offset - fd->file_offset) >> 9;
-            fd->file_offset = offset;
-        } else {
-            uint32_t next_cluster = f32_get_next_cluster(fd->current_cluster);
-            if(F32_CLUSTER_IS_EOF(next_cluster)) {
-                fd->current_cluster = fd->start_cluster;
-                fd->sector_count = 0;
-                fd->file_offset = 0;
-                return 1;
-            }
 
-            fd->current_cluster = next_cluster;
-            fd->file_offset += fs->sec_per_cluster<<9;
+    while(index != target) {
+        if(f32_next_file_cluster(fd, 0)) {
+            fd->current_cluster = fd->start_cluster;
+            fd->sector_count = 0;
+            fd->file_offset = 0;
+            return 1;
         }
+        index++;
+    }
+
+    fd->sector_count = (offset - target*cluster_bytes) >> 9;
+    fd->file_offset = offset;
+
+    return 0;
+}
+
+#if F32_HANDLE_BUFFERS
+/**
+ * Write the handle's buffered sector to the card if it was modified
+ */
+static uint8_t f32_handle_flush(f32_file * fd) {
+    if(fd->flags & F32_FILE_BUF_DIRTY) {
+        if(io_write_block(fd->buffered_sector, fd->sec.data)) {
+            return 1;
+        }
+        fd->flags &= ~F32_FILE_BUF_DIRTY;
+    }
+
+    return 0;
+}
+
+/**
+ * Forget the buffered sector if it is about to be overwritten whole
+ */
+static void f32_handle_drop(f32_file * fd, uint32_t sector, uint16_t count) {
+    if(fd->buffered_sector - sector < count) {
+        fd->buffered_sector = 0;
+        fd->flags &= ~F32_FILE_BUF_DIRTY;
+    }
+}
+#endif
+
+/**
+ * Last entry of the extent map, which always starts with the first cluster
+ */
+static f32_extent * f32_extent_last(f32_file * fd) {
+    if(fd->extent_count == 0) {
+        fd->extents[0].file_cluster = 0;
+        fd->extents[0].cluster = fd->start_cluster;
+        fd->extents[0].length = 1;
+        fd->extent_count = 1;
+    }
+
+    return &fd->extents[fd->extent_count - 1];
+}
+
+/**
+ * Record a hop along the cluster chain of fd in its extent map. Only hops
+ * from the last mapped cluster extend the map.
+ */
+static void f32_extent_note(f32_file * fd, uint32_t cluster, uint32_t next_cluster) {
+    f32_extent * ex = f32_extent_last(fd);
+    if(cluster != ex->cluster + ex->length - 1) {
+        return;
+    }
+
+    if(next_cluster == cluster + 1) {
+        ex->length++;
+    } else if(fd->extent_count < F32_EXTENTS) {
+        ex[1].file_cluster = ex->file_cluster + ex->length;
+        ex[1].cluster = next_cluster;
+        ex[1].length = 1;
+        fd->extent_count++;
+    }
+}
+
+/**
+ * Move fd on to the next cluster of its chain
+ *
+ * @param allocate  Extend the chain with a free cluster if fd is at its end
+ *
+ * @return 0 on success, 1 at the end of the chain or if no cluster is free
+ */
+static uint8_t f32_next_file_cluster(f32_file * fd, uint8_t allocate) {
+    uint32_t next_cluster = f32_get_next_cluster(fd->current_cluster);
+    if(F32_CLUSTER_IS_EOF(next_cluster)) {
+        if(!allocate) {
+            return 1;
+        }
+
+        // allocate new cluster
+        uint32_t free_cluster = f32_allocate_free();
+        if(free_cluster == 0) {
+            return 1;
+        }
+
+        if(f32_point_cluster(fd->current_cluster, free_cluster)) {
+            return 1;
+        }
+        next_cluster = free_cluster;
+    }
+
+    f32_extent_note(fd, fd->current_cluster, next_cluster);
+    fd->current_cluster = next_cluster;
+    fd->sector_count = 0;
+
+    return 0;
+}
+
+uint8_t f32_prealloc(f32_file * fd, uint32_t bytes) {
+    f32_buf_taken();
+
+    uint32_t cluster_bytes = (uint32_t)fs->sec_per_cluster << 9;
+    uint32_t needed = (bytes + cluster_bytes - 1) / cluster_bytes;
+
+    // find the end of the chain, extending the extent map on the way
+    f32_extent * ex = f32_extent_last(fd);
+    uint32_t length = ex->file_cluster + ex->length;
+    uint32_t last_cluster = ex->cluster + ex->length - 1;
+    uint32_t next_cluster;
+    while(!F32_CLUSTER_IS_EOF(next_cluster = f32_get_next_cluster(last_cluster))) {
+        f32_extent_note(fd, last_cluster, next_cluster);
+        last_cluster = next_cluster;
+        length++;
+    }
+
+    if(length >= needed) {
+        return 0;
+    }
+    needed -= length;
+
+    // prefer the clusters right after the file so its last run grows
+    uint32_t run = f32_find_free_run(last_cluster + 1, needed);
+    if(run == 0) {
+        return 1;
+    }
+
+    // link the run in one pass over the FAT, writing each sector once
+    uint32_t cluster = run;
+    while(cluster < run + needed) {
+        if(f32_fat_load(fs->fat_start + (cluster >> 7))) {
+            return 1;
+        }
+
+        uint32_t * entries = (uint32_t*)fat_buf->data;
+        do {
+            entries[cluster & 0x7F] = (cluster == run + needed - 1) ? F32_CLUSTER_EOF : cluster + 1;
+            cluster++;
+        } while((cluster & 0x7F) && (cluster < run + needed));
+
+        if(f32_fat_modified()) {
+            return 1;
+        }
+    }
+
+    if(f32_point_cluster(last_cluster, run)) {
+        return 1;
+    }
+
+    for(cluster = run; cluster < run + needed; cluster++) {
+        f32_extent_note(fd, last_cluster, cluster);
+        last_cluster = cluster;
+    }
+
+    if(fs->free_count != FSI_UNKNOWN) {
+        fs->free_count -= needed;
+    }
+    fs->next_free = run + needed;
+    fs->fsinfo_dirty = 1;
+
+    return 0;
+}
+
+/**
+ * Find count contiguous free clusters, searching from the given cluster
+ * and wrapping around to the start of the volume
+ *
+ * @return First cluster of the run, 0 if there is none
+ */
+static uint32_t f32_find_free_run(uint32_t cluster, uint32_t count) {
+    uint32_t run = 0;
+    uint32_t run_length = 0;
+    uint32_t left = fs->cluster_count - 2;
+
+    while(left > 0) {
+        // runs can't wrap past the end of the volume
+        if(cluster >= fs->cluster_count) {
+            cluster = 2;
+            run_length = 0;
+        }
+
+        if(f32_fat_load(fs->fat_start + (cluster >> 7))) {
+            return 0;
+        }
+
+        // the rest of the entries in this FAT sector
+        const uint32_t * entries = (const uint32_t*)fat_buf->data;
+        do {
+            if((entries[cluster & 0x7F] & 0x0FFFFFFF) != F32_CLUSTER_FREE) {
+                run_length = 0;
+            } else {
+                if(run_length++ == 0) {
+                    run = cluster;
+                }
+
+                if(run_length == count) {
+                    return run;
+                }
+            }
+
+            cluster++;
+            left--;
+        } while((cluster & 0x7F) && (cluster < fs->cluster_count) && (left > 0));
     }
 
     return 0;
 }
 
 static uint32_t _f32_find_free(uint8_t allocate) {
-    uint32_t cluster = 0;
-    for(uint32_t i = 0; i < fs->fat_size; i++) {
+    // start from the hint and wrap around to the first data cluster
+    uint32_t cluster = fs->next_free;
+    uint32_t left = fs->cluster_count - 2;
+    while(left > 0) {
+        if(cluster >= fs->cluster_count) {
+            cluster = 2;
+        }
+
+        if(f32_fat_load(fs->fat_start + (cluster >> 7))) {
+            return 0;
+        }
 
-        io_read_block(fs->fat_start + i, buf->data);
-        for(uint8_t j = 0; j < SEC_SIZE/FAT32_ENTRY_SIZE; j++) {
-            if(*(uint32_t*)&buf->data[j*FAT32_ENTRY_SIZE] == F32_CLUSTER_FREE) {
+        // the rest of the entries in this FAT sector
+        uint32_t * entries = (uint32_t*)fat_buf->data;
+        do {
+            uint32_t * entry = &entries[cluster & 0x7F];
+            if((*entry & 0x0FFFFFFF) == F32_CLUSTER_FREE) {
                 if(allocate) {
-                    *(uint32_t*)&buf->data[j*FAT32_ENTRY_SIZE] |= F32_CLUSTER_EOF;
-                    io_write_block(fs->fat_start + i, buf->data);
+                    *entry |= F32_CLUSTER_EOF;
+                    if(f32_fat_modified()) {
+                        return 0;
+                    }
+
+                    if(fs->free_count != FSI_UNKNOWN) {
+                        fs->free_count--;
+                    }
+                    fs->next_free = cluster + 1;
+                    fs->fsinfo_dirty = 1;
                 }
                 return cluster;
             }
 
             cluster++;
-        }
+            left--;
+        } while((cluster & 0x7F) && (cluster < fs->cluster_count) && (left > 0));
     }
 
     return 0;
@@ -495,25 +1255,148 @@ static inline uint32_t f32_find_free() {
 }
 
 static uint32_t f32_count_free() {
-    uint32_t cluster = 0;
-    for(uint32_t i = 0; i < fs->fat_size; i++) {
-        io_read_block(fs->fat_start + i, buf->data);
-        for(uint8_t j = 0; j < SEC_SIZE/FAT32_ENTRY_SIZE; j++) {
-            if(*(uint32_t*)&buf->data[j*FAT32_ENTRY_SIZE] == F32_CLUSTER_FREE) {
-                cluster++;
+    if(fs->free_count != FSI_UNKNOWN) {
+        return fs->free_count;
+    }
+
+    uint32_t count = 0;
+    uint32_t cluster = 2;
+    while(cluster < fs->cluster_count) {
+        if(f32_fat_load(fs->fat_start + (cluster >> 7))) {
+            return 0;
+        }
+
+        // every entry of this FAT sector
+        const uint32_t * entries = (const uint32_t*)fat_buf->data;
+        do {
+            if((entries[cluster & 0x7F] & 0x0FFFFFFF) == F32_CLUSTER_FREE) {
+                count++;
             }
+            cluster++;
+        } while((cluster & 0x7F) && (cluster < fs->cluster_count));
+    }
+
+    fs->free_count = count;
+    fs->fsinfo_dirty = 1;
+    return count;
+}
+
+/**
+ * Load the free cluster count and next free hint from the FSInfo sector.
+ * Missing or invalid values are treated as unknown.
+ */
+static uint8_t f32_fsinfo_load(void) {
+    fs->free_count = FSI_UNKNOWN;
+    fs->next_free = 2;
+    fs->fsinfo_dirty = 0;
+
+    if(fs->fsinfo_sec == 0) {
+        return 0;
+    }
+
+    if(f32_fat_load(fs->fsinfo_sec)) {
+        return 1;
+    }
+
+    const FSInfoStruct * fsi = (const FSInfoStruct*)fat_buf->data;
+    if((fsi->FSI_LeadSig != FSI_LEAD_SIG) ||
+       (fsi->FSI_StrucSig != FSI_STRUC_SIG) ||
+       (fsi->FSI_TrailSig != FSI_TRAIL_SIG))
+    {
+        fs->fsinfo_sec = 0;
+        return 0;
+    }
+
+    if(fsi->FSI_Free_Count < fs->cluster_count) {
+        fs->free_count = fsi->FSI_Free_Count;
+    }
+
+    if((fsi->FSI_Nxt_Free >= 2) && (fsi->FSI_Nxt_Free < fs->cluster_count)) {
+        fs->next_free = fsi->FSI_Nxt_Free;
+    }
+
+    return 0;
+}
+
+/**
+ * Write the in-memory free count and hint back to the FSInfo sector
+ */
+static uint8_t f32_fsinfo_flush(void) {
+    if(!fs->fsinfo_dirty || (fs->fsinfo_sec == 0)) {
+        return 0;
+    }
+
+    if(f32_fat_load(fs->fsinfo_sec)) {
+        return 1;
+    }
+
+    FSInfoStruct * fsi = (FSInfoStruct*)fat_buf->data;
+    fsi->FSI_Free_Count = fs->free_count;
+    fsi->FSI_Nxt_Free = fs->next_free;
+    if(f32_fat_modified() || f32_fat_flush()) {
+        return 1;
+    }
+
+    fs->fsinfo_dirty = 0;
+    return 0;
+}
+
+/**
+ * Make the given FAT sector resident in the FAT window, writing back the
+ * previous one if it was modified
+ */
+static uint8_t f32_fat_load(uint32_t sec) {
+    if(sec == fat_win_sec) {
+        return 0;
+    }
+
+    if(f32_fat_flush()) {
+        return 1;
+    }
+
+#if !F32_FAT_WINDOW
+    f32_buf_taken();
+#endif
+    if(io_read_block(sec, fat_buf->data)) {
+        fat_win_sec = 0;
+        return 1;
+    }
+
+    fat_win_sec = sec;
+    return 0;
+}
+
+static uint8_t f32_fat_flush(void) {
+    if(fat_win_dirty) {
+        if(io_write_block(fat_win_sec, fat_buf->data)) {
+            return 1;
         }
+        fat_win_dirty = 0;
     }
 
-    return cluster;
+    return 0;
 }
 
+/**
+ * Mark the FAT window as modified. Without a dedicated window the shared
+ * buffer is about to be reused, so the sector is written out immediately.
+ */
+static uint8_t f32_fat_modified(void) {
+    fat_win_dirty = 1;
+#if F32_FAT_WINDOW
+    return 0;
+#else
+    return f32_fat_flush();
+#endif
+}
 
 static uint32_t f32_get_next_cluster(uint32_t current_cluster) {
-    uint16_t fat_sec = fs->fat_start + (current_cluster>>7);
+    uint32_t fat_sec = fs->fat_start + (current_cluster>>7);
     uint16_t fat_entry = (current_cluster*FAT32_ENTRY_SIZE) & 0x1FF;
-    io_read_block(fat_sec, buf->data);
-    return *(uint32_t*)&buf->data[fat_entry] & 0x0FFFFFFF;
+    if(f32_fat_load(fat_sec)) {
+        return F32_CLUSTER_EOF;
+    }
+    return *(uint32_t*)&fat_buf->data[fat_entry] & 0x0FFFFFFF;
 }
 
 static inline uint32_t f32_sector_to_cluster(uint32_t sector) {
@@ -528,7 +1411,127 @@ static inline uint8_t f32_dir_entry_empty(const DIR_Entry * en) {
     return  (en->DIR_Name[0] == 0xE5) || (en->DIR_Name[0] == 0x00);
 }
 
-static uint8_t f32_find_file(uint32_t dir_cluster, const char * fname, const char * ext, f32_file * fd) {
+/**
+ * Point fd at the start of a file
+ */
+static void f32_file_at(
+        f32_file * fd,
+        uint32_t start_cluster,
+        uint32_t size,
+        uint32_t entry_sector,
+        uint16_t entry_offset)
+{
+    fd->start_cluster = start_cluster;
+    fd->size = size;
+    fd->current_cluster = start_cluster;
+    fd->file_offset = 0;
+    fd->sector_count = 0;
+    fd->file_entry_sector = entry_sector;
+    fd->file_entry_offset = entry_offset;
+    fd->flags = 0;
+    fd->unsynced_bytes = 0;
+    fd->extent_count = 0;
+}
+
+#if F32_NAME_CACHE
+static f32_name_entry * f32_name_lookup(uint32_t dir_cluster, const char * fname, const char * ext) {
+    for(uint8_t i = 0; i < F32_NAME_CACHE; i++) {
+        f32_name_entry * ne = &name_cache[i];
+        if(ne->used && (ne->dir_cluster == dir_cluster) &&
+           (memcmp(ne->name, fname, 8) == 0) && (memcmp(&ne->name[8], ext, 3) == 0))
+        {
+            return ne;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Remember where a name was found, or that it wasn't if fd is NULL
+ */
+static void f32_name_store(uint32_t dir_cluster, const char * fname, const char * ext, const f32_file * fd) {
+#if !F32_NAME_CACHE_NEGATIVE
+    if(fd == NULL) {
+        return;
+    }
+#endif
+
+    // a created file takes over its name's negative entry
+    f32_name_entry * ne = f32_name_lookup(dir_cluster, fname, ext);
+    if(ne == NULL) {
+        ne = &name_cache[name_next];
+        name_next = (name_next + 1) % F32_NAME_CACHE;
+    }
+
+    ne->dir_cluster = dir_cluster;
+    memcpy(ne->name, fname, 8);
+    memcpy(&ne->name[8], ext, 3);
+    ne->used = 1;
+    ne->start_cluster = fd ? fd->start_cluster : 0;
+    ne->size = fd ? fd->size : 0;
+    ne->entry_sector = fd ? fd->file_entry_sector : 0;
+    ne->entry_offset = fd ? fd->file_entry_offset : 0;
+}
+
+/**
+ * Follow a directory entry that was just written for fd
+ */
+static void f32_name_update(const f32_file * fd) {
+    for(uint8_t i = 0; i < F32_NAME_CACHE; i++) {
+        f32_name_entry * ne = &name_cache[i];
+        if(ne->used && (ne->entry_sector == fd->file_entry_sector) &&
+           (ne->entry_offset == fd->file_entry_offset))
+        {
+            ne->size = fd->size;
+        }
+    }
+}
+#endif
+
+#if F32_PATH_CACHE
+/**
+ * Find the longest cached directory that path starts with
+ *
+ * @return Length of the cached prefix, 0 if there is none
+ */
+static uint8_t f32_path_lookup(const char * path, uint8_t len, uint32_t * cluster) {
+    uint8_t best = 0;
+    for(uint8_t i = 0; i < F32_PATH_CACHE; i++) {
+        const f32_path_entry * pe = &path_cache[i];
+        if((pe->len > best) && (pe->len <= len) &&
+           ((pe->len == len) || (path[pe->len] == '/')) &&
+           (memcmp(pe->path, path, pe->len) == 0))
+        {
+            best = pe->len;
+            *cluster = pe->cluster;
+        }
+    }
+
+    return best;
+}
+
+static void f32_path_store(const char * path, uint8_t len, uint32_t cluster) {
+    for(uint8_t i = 0; i < F32_PATH_CACHE; i++) {
+        if((path_cache[i].len == len) && (memcmp(path_cache[i].path, path, len) == 0)) {
+            return;
+        }
+    }
+
+    f32_path_entry * pe = &path_cache[path_next];
+    path_next = (path_next + 1) % F32_PATH_CACHE;
+    memcpy(pe->path, path, len);
+    pe->len = len;
+    pe->cluster = cluster;
+}
+#endif
+
+/**
+ * Read a directory until fname/ext or the end of the directory is found
+ *
+ * @param sectors   Incremented for every directory sector read
+ */
+static uint8_t f32_scan_dir(uint32_t dir_cluster, const char * fname, const char * ext, f32_file * fd, uint16_t * sectors) {
     uint32_t dir_sec;
 
     while(!F32_CLUSTER_IS_EOF(dir_cluster)) {
@@ -536,14 +1539,16 @@ static uint8_t f32_find_file(uint32_t dir_cluster, const char * fname, const cha
 
         // iterate through every sector in the cluster
         for(uint32_t sec = 0; sec < fs->sec_per_cluster; sec++) {
-            io_read_block(dir_sec + sec, buf->data);
+            io_stats_next(F32_CLASS_DIR);
+            f32_buf_read(dir_sec + sec);
+            (*sectors)++;
 
             // iterate through the entries in current sector
             for(uint16_t i = 0; i < SEC_SIZE/sizeof(DIR_Entry); i++) {
                 DIR_Entry * en = (DIR_Entry*)&buf->data[i*sizeof(DIR_Entry)];
 
-                // skip any empty entries
-                if(en->DIR_Name[0] == 0xE5) {
+                // skip any empty entries and long name parts
+                if((en->DIR_Name[0] == 0xE5) || (en->DIR_Attr == ATTR_LONG_NAME)) {
                     continue;
                 }
 
@@ -554,13 +1559,8 @@ static uint8_t f32_find_file(uint32_t dir_cluster, const char * fname, const cha
 
                 // check if file matches and return if so
                 if(f32_check_file(fname, ext, en)) {
-                    fd->start_cluster = ((uint32_t)en->DIR_FstClusHI << 16) | (en->DIR_FstClusLO);
-                    fd->size = en->DIR_FileSize;
-                    fd->current_cluster = fd->start_cluster;
-                    fd->file_offset = 0;
-                    fd->sector_count = 0;
-                    fd->file_entry_sector = dir_sec;
-                    fd->file_entry_offset = i*sizeof(DIR_Entry);
+                    f32_file_at(fd, ((uint32_t)en->DIR_FstClusHI << 16) | (en->DIR_FstClusLO),
+                        en->DIR_FileSize, dir_sec + sec, i*sizeof(DIR_Entry));
                     return 1;
                 }
             }
@@ -572,6 +1572,249 @@ static uint8_t f32_find_file(uint32_t dir_cluster, const char * fname, const cha
     return 0;
 }
 
+static uint8_t f32_find_file(uint32_t dir_cluster, const char * fname, const char * ext, f32_file * fd) {
+#if F32_NAME_CACHE
+    f32_name_entry * ne = f32_name_lookup(dir_cluster, fname, ext);
+    if(ne != NULL) {
+        if(ne->entry_sector == 0) {
+            return 0;
+        }
+
+        f32_file_at(fd, ne->start_cluster, ne->size, ne->entry_sector, ne->entry_offset);
+        return 1;
+    }
+#endif
+
+    uint8_t found;
+    uint16_t sectors = 0;
+#if F32_DIR_INDEX
+    if(dir_cluster == dir_index.dir_cluster) {
+        found = f32_index_find(fname, ext, fd);
+    } else
+#endif
+    {
+        found = f32_scan_dir(dir_cluster, fname, ext, fd, &sectors);
+    }
+
+#if F32_NAME_CACHE
+    f32_name_store(dir_cluster, fname, ext, found ? fd : NULL);
+#endif
+
+#if F32_DIR_INDEX
+    // index directories that proved expensive to scan, unless they are
+    // known not to fit. Once the index is in use or a build has failed,
+    // a new directory only gets it after repeated scans, so directories
+    // used in turn don't keep rebuilding it.
+    if((sectors >= F32_DIR_INDEX_SECTORS) && (dir_cluster != index_overflow)) {
+        if(dir_cluster != index_candidate) {
+            index_candidate = dir_cluster;
+            index_scans = 0;
+        }
+
+        uint8_t idle = (dir_index.dir_cluster == 0) && (index_overflow == 0);
+        if(idle || (++index_scans >= F32_DIR_INDEX_SWITCH)) {
+            index_candidate = 0;
+            f32_index_build(dir_cluster);
+        }
+    }
+#else
+    (void)sectors;
+#endif
+
+    return found;
+}
+
+#if F32_DIR_INDEX
+static uint16_t f32_index_hash(const char * fname, const char * ext) {
+    uint16_t h = 0;
+    for(uint8_t i = 0; i < 11; i++) {
+        h = h*31 + (uint8_t)((i < 8) ? fname[i] : ext[i - 8]);
+    }
+
+    return h;
+}
+
+/**
+ * Sector and byte offset of an entry of the indexed directory
+ */
+static uint8_t f32_index_locate(uint16_t pos, uint32_t * sector, uint16_t * offset) {
+    const uint16_t per_cluster = fs->sec_per_cluster*(SEC_SIZE/sizeof(DIR_Entry));
+
+    uint32_t cluster = dir_index.dir_cluster;
+    for(uint16_t n = pos/per_cluster; n > 0; n--) {
+        cluster = f32_get_next_cluster(cluster);
+        if(F32_CLUSTER_IS_EOF(cluster)) {
+            return 1;
+        }
+    }
+
+    pos %= per_cluster;
+    *sector = f32_cluster_to_sector(cluster) + pos/(SEC_SIZE/sizeof(DIR_Entry));
+    *offset = (pos % (SEC_SIZE/sizeof(DIR_Entry)))*sizeof(DIR_Entry);
+    return 0;
+}
+
+static uint8_t f32_index_insert(uint16_t hash, uint16_t pos) {
+    if((dir_index.count >= F32_DIR_INDEX_SLOTS*3/4) || (pos == 0xFFFF)) {
+        return 1;
+    }
+
+    uint16_t i = hash % F32_DIR_INDEX_SLOTS;
+    while(dir_index.slots[i].pos) {
+        i = (i + 1) % F32_DIR_INDEX_SLOTS;
+    }
+
+    dir_index.slots[i].hash = hash;
+    dir_index.slots[i].pos = pos + 1;
+    dir_index.count++;
+    return 0;
+}
+
+/**
+ * Look a name up in the index. Only entries whose hash matches are read,
+ * and a name that isn't in the index isn't in the directory.
+ */
+static uint8_t f32_index_find(const char * fname, const char * ext, f32_file * fd) {
+    uint16_t hash = f32_index_hash(fname, ext);
+    for(uint16_t i = hash % F32_DIR_INDEX_SLOTS; dir_index.slots[i].pos; i = (i + 1) % F32_DIR_INDEX_SLOTS) {
+        if(dir_index.slots[i].hash != hash) {
+            continue;
+        }
+
+        uint32_t sector;
+        uint16_t offset;
+        if(f32_index_locate(dir_index.slots[i].pos - 1, &sector, &offset)) {
+            return 0;
+        }
+
+        io_stats_next(F32_CLASS_DIR);
+        if(io_read_block(sector, buf->data)) {
+            return 0;
+        }
+
+        const DIR_Entry * en = (const DIR_Entry*)&buf->data[offset];
+        if(f32_check_file(fname, ext, en)) {
+            f32_file_at(fd, ((uint32_t)en->DIR_FstClusHI << 16) | (en->DIR_FstClusLO),
+                en->DIR_FileSize, sector, offset);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Index every name of a directory in one pass. Directories with more
+ * names than the index holds keep being scanned.
+ */
+static void f32_index_build(uint32_t dir_cluster) {
+    memset(&dir_index, 0, sizeof(dir_index));
+    dir_index.free_pos = F32_DIR_INDEX_UNKNOWN;
+    dir_index.end_pos = F32_DIR_INDEX_UNKNOWN;
+
+    uint32_t pos = 0;
+    for(uint32_t cluster = dir_cluster; !F32_CLUSTER_IS_EOF(cluster); cluster = f32_get_next_cluster(cluster)) {
+        uint32_t dir_sec = f32_cluster_to_sector(cluster);
+
+        for(uint32_t sec = 0; sec < fs->sec_per_cluster; sec++) {
+            // past the end marker only the size of the directory is needed
+            if(dir_index.end_pos != F32_DIR_INDEX_UNKNOWN) {
+                pos += SEC_SIZE/sizeof(DIR_Entry);
+                continue;
+            }
+
+            io_stats_next(F32_CLASS_DIR);
+            if(f32_buf_read(dir_sec + sec)) {
+                return;
+            }
+
+            for(uint16_t i = 0; i < SEC_SIZE/sizeof(DIR_Entry); i++, pos++) {
+                const DIR_Entry * en = (const DIR_Entry*)&buf->data[i*sizeof(DIR_Entry)];
+                if(dir_index.end_pos != F32_DIR_INDEX_UNKNOWN) {
+                    continue;
+                }
+
+                if(f32_dir_entry_empty(en)) {
+                    if(dir_index.free_pos == F32_DIR_INDEX_UNKNOWN) {
+                        dir_index.free_pos = pos;
+                    }
+
+                    if(en->DIR_Name[0] == 0x00) {
+                        dir_index.end_pos = pos;
+                    }
+                    continue;
+                }
+
+                if((en->DIR_Attr != ATTR_LONG_NAME) &&
+                   f32_index_insert(f32_index_hash((const char*)en->DIR_Name, (const char*)&en->DIR_Name[8]), pos))
+                {
+                    index_overflow = dir_cluster;
+                    return;
+                }
+            }
+        }
+    }
+
+    if(pos >= F32_DIR_INDEX_UNKNOWN) {
+        index_overflow = dir_cluster;
+        return;
+    }
+
+    // a full directory has no end marker
+    dir_index.capacity = pos;
+    if(dir_index.end_pos == F32_DIR_INDEX_UNKNOWN) {
+        dir_index.end_pos = pos;
+    }
+    if(dir_index.free_pos == F32_DIR_INDEX_UNKNOWN) {
+        dir_index.free_pos = pos;
+    }
+
+    dir_index.dir_cluster = dir_cluster;
+}
+
+/**
+ * Entry slot for a new short name, taken from the index
+ *
+ * @return 0 on success, 1 if the directory has to be scanned for one
+ */
+static uint8_t f32_index_free(uint32_t * sector, uint16_t * offset) {
+    if(dir_index.free_pos >= dir_index.capacity) {
+        return 1;
+    }
+
+    return f32_index_locate(dir_index.free_pos, sector, offset);
+}
+
+/**
+ * Add a file just created in the indexed directory. Files that got their
+ * entries from a scan rather than from f32_index_free drop the index.
+ */
+static void f32_index_created(uint32_t dir_cluster, const char * short_name, uint8_t entries) {
+    if(dir_cluster != dir_index.dir_cluster) {
+        return;
+    }
+
+    uint16_t pos = dir_index.free_pos;
+    if((entries > 1) || (pos >= dir_index.capacity)) {
+        dir_index.dir_cluster = 0;
+        return;
+    }
+
+    if(f32_index_insert(f32_index_hash(short_name, &short_name[8]), pos)) {
+        dir_index.dir_cluster = 0;
+        index_overflow = dir_cluster;
+        return;
+    }
+
+    // everything past the end marker is free. Later holes are left to the
+    // next scan.
+    if(pos == dir_index.end_pos) {
+        dir_index.end_pos++;
+    }
+    dir_index.free_pos = dir_index.end_pos;
+}
+#endif
+
 static uint8_t f32_check_file(const char * fname, const char * ext, const DIR_Entry * en) {
     for(int i = 0; i < 8; i++) {
         // printf("0x%02X : 0x%02X\n", fname[i], en->DIR_Name[i]);
@@ -588,15 +1831,231 @@ static uint8_t f32_check_file(const char * fname, const char * ext, const DIR_En
 
 static uint8_t f32_point_cluster(uint32_t current_cluster, uint32_t free_cluster) {
     uint32_t sec = fs->fat_start + ((FAT32_ENTRY_SIZE*current_cluster) >> 9);
-    if(io_read_block(sec, buf->data)) {
+    if(f32_fat_load(sec)) {
         return 1;
     }
 
     uint16_t offset = FAT32_ENTRY_SIZE*(current_cluster & 0x7F);
-    *(uint32_t*)&buf->data[offset] = (free_cluster) & 0x0FFFFFFF;
-    if(io_write_block(sec, buf->data)) {
+    *(uint32_t*)&fat_buf->data[offset] = (free_cluster) & 0x0FFFFFFF;
+    return f32_fat_modified();
+}
+
+#if F32_LFN
+/**
+ * Find a file by its long name. The name is compared one entry at a time
+ * as the directory streams past: a set of long name entries is dropped as
+ * soon as its part count, its checksum or one of its parts doesn't match,
+ * and a full match only counts if the short entry after it has the same
+ * checksum.
+ */
+static uint8_t f32_find_long_file(uint32_t dir_cluster, const char * name, uint8_t len, f32_file * fd) {
+    uint8_t parts = (len + LFN_CHARS - 1)/LFN_CHARS;
+    uint8_t next = 0; /* part expected next, 0 if there is no candidate */
+    uint8_t matched = 0; /* every part matched, the short entry is next */
+    uint8_t checksum = 0;
+
+    while(!F32_CLUSTER_IS_EOF(dir_cluster)) {
+        uint32_t dir_sec = f32_cluster_to_sector(dir_cluster);
+
+        // iterate through every sector in the cluster
+        for(uint32_t sec = 0; sec < fs->sec_per_cluster; sec++) {
+            io_stats_next(F32_CLASS_DIR);
+            if(f32_buf_read(dir_sec + sec)) {
+                return 0;
+            }
+
+            for(uint16_t i = 0; i < SEC_SIZE/sizeof(DIR_Entry); i++) {
+                const uint8_t * en = &buf->data[i*sizeof(DIR_Entry)];
+                const DIR_Entry * de = (const DIR_Entry*)en;
+
+                // all following entries are empty
+                if(en[0] == 0x00) {
+                    return 0;
+                }
+
+                if(en[0] == 0xE5) {
+                    next = 0;
+                    matched = 0;
+                    continue;
+                }
+
+                if(de->DIR_Attr == ATTR_LONG_NAME) {
+                    matched = 0;
+
+                    // a name of the wrong length is skipped without comparing it
+                    if(en[0] & LFN_LAST) {
+                        next = ((en[0] & LFN_ORD_MASK) == parts) ? parts : 0;
+                        checksum = en[LFN_CHECKSUM];
+                    }
+
+                    if((next == 0) || ((en[0] & LFN_ORD_MASK) != next) ||
+                       (en[LFN_CHECKSUM] != checksum) || !f32_lfn_match(en, name, len))
+                    {
+                        next = 0;
+                        continue;
+                    }
+
+                    matched = (--next == 0);
+                    continue;
+                }
+
+                if(matched && (f32_lfn_checksum(de->DIR_Name) == checksum)) {
+                    f32_file_at(fd, ((uint32_t)de->DIR_FstClusHI << 16) | (de->DIR_FstClusLO),
+                        de->DIR_FileSize, dir_sec + sec, i*sizeof(DIR_Entry));
+                    return 1;
+                }
+
+                next = 0;
+                matched = 0;
+            }
+        }
+
+        dir_cluster = f32_get_next_cluster(dir_cluster);
+    }
+
+    return 0;
+}
+
+/**
+ * Character as it appears in a short name, 0 if it is left out
+ */
+static char f32_alias_char(char c) {
+    if((c == ' ') || (c == '.')) {
+        return 0;
+    }
+
+    if((c >= 'a') && (c <= 'z')) {
+        return c - 'a' + 'A';
+    }
+
+    if((c < ' ') || (c > '~') || strchr("\"*+,/:;<=>?[\\]|", c)) {
+        return '_';
+    }
+
+    return c;
+}
+
+/**
+ * Make up a short name for a long one: the first characters of the name
+ * and of its last extension with a ~N tail that no other file uses
+ *
+ * @return 0 on success, 1 if the long name is invalid or no tail is free
+ */
+static uint8_t f32_short_alias(
+        uint32_t dir_cluster,
+        const char * name,
+        uint8_t len,
+        char * short_name,
+        f32_file * fd)
+{
+    // names made of dots alone are reserved for . and .., and lookups only
+    // match ASCII
+    uint8_t dots = 0;
+    for(uint8_t i = 0; i < len; i++) {
+        if(((uint8_t)name[i] < ' ') || ((uint8_t)name[i] > 0x7F) || strchr("\"*/:<>?\\|", name[i])) {
+            return 1;
+        }
+        dots += (name[i] == '.');
+    }
+
+    if(dots == len) {
+        return 1;
+    }
+
+    // the extension follows the last dot, a leading dot doesn't count
+    const char * end = &name[len];
+    const char * dot = end;
+    while((--dot > name) && (*dot != '.'));
+
+    memset(short_name, 0x20, 11);
+    uint8_t base = 0;
+    for(const char * c = name; (c < ((dot > name) ? dot : end)) && (base < 8); c++) {
+        char ch = f32_alias_char(*c);
+        if(ch) {
+            short_name[base++] = ch;
+        }
+    }
+
+    if(base == 0) {
+        short_name[base++] = '_';
+    }
+
+    uint8_t ext = 8;
+    for(const char * c = dot + 1; (dot > name) && (c < end) && (ext < 11); c++) {
+        char ch = f32_alias_char(*c);
+        if(ch) {
+            short_name[ext++] = ch;
+        }
+    }
+
+    for(uint8_t n = 1; n < 100; n++) {
+        uint8_t tail = (n < 10) ? 2 : 3;
+        uint8_t pos = MIN(base, 8 - tail);
+
+        memset(&short_name[pos], 0x20, 8 - pos);
+        short_name[pos++] = '~';
+        if(n >= 10) {
+            short_name[pos++] = '0' + n/10;
+        }
+        short_name[pos] = '0' + n%10;
+
+        if(!f32_find_file(dir_cluster, short_name, &short_name[8], fd)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Write the long name entries for name into the free run at sector and
+ * offset, and move them on to the slot left for the short entry
+ */
+static uint8_t f32_create_long_name(
+        const char * name,
+        uint8_t len,
+        const char * short_name,
+        uint32_t * sector,
+        uint16_t * offset)
+{
+    uint8_t parts = (len + LFN_CHARS - 1)/LFN_CHARS;
+    uint8_t checksum = f32_lfn_checksum((const uint8_t*)short_name);
+
+    io_stats_next(F32_CLASS_DIR);
+    if(f32_buf_read(*sector)) {
+        return 1;
+    }
+
+    // the last part comes first
+    for(uint8_t part = parts; part > 0; part--) {
+        if(*offset == SEC_SIZE) {
+            io_stats_next(F32_CLASS_DIR);
+            if(io_write_block(*sector, buf->data)) {
+                return 1;
+            }
+
+            (*sector)++;
+            *offset = 0;
+            io_stats_next(F32_CLASS_DIR);
+            if(f32_buf_read(*sector)) {
+                return 1;
+            }
+        }
+
+        f32_lfn_fill(&buf->data[*offset], name, len, (part == parts) ? (part | LFN_LAST) : part, checksum);
+        *offset += sizeof(DIR_Entry);
+    }
+
+    io_stats_next(F32_CLASS_DIR);
+    if(io_write_block(*sector, buf->data)) {
         return 1;
     }
 
+    if(*offset == SEC_SIZE) {
+        (*sector)++;
+        *offset = 0;
+    }
+
     return 0;
 }
+#endif
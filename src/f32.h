@@ -11,11 +11,182 @@
 #define F32_NO_RTC      0
 #endif
 
+/**
+ * Keep a dedicated FAT sector resident for cluster chain walks (costs one
+ * sector of RAM). When disabled, FAT lookups reuse the shared data buffer.
+ */
+#ifndef F32_FAT_WINDOW
+#ifdef DESKTOP
+#define F32_FAT_WINDOW  1
+#else
+#define F32_FAT_WINDOW  0
+#endif
+#endif
+
+/**
+ * An open file writes its directory entry (size and timestamp) back once
+ * this many bytes or seconds of data are unsynced, as well as on f32_sync
+ * and f32_close. 0 disables the limit. The time limit needs the RTC.
+ */
+#ifndef F32_SYNC_BYTES
+#define F32_SYNC_BYTES      4096
+#endif
+
+#ifndef F32_SYNC_SECONDS
+#define F32_SYNC_SECONDS    10
+#endif
+
+/**
+ * Number of contiguous cluster runs each open file remembers so seeks can
+ * skip walking the FAT. Costs 12 bytes of RAM per entry and handle.
+ */
+#ifndef F32_EXTENTS
+#define F32_EXTENTS         4
+#endif
+
+/**
+ * Count block I/O by sector class and time card commands, see
+ * f32_get_stats. Compiled out entirely when 0.
+ */
+#ifndef F32_STATS
+#define F32_STATS           0
+#endif
+
+/**
+ * Number of latency histogram buckets. Bucket n counts card commands that
+ * took fewer than 4^(n+1) clock ticks, the last bucket takes the rest.
+ * The clock is F32_STATS_CLOCK(), a free-running tick counter such as a
+ * timer register. The desktop build defaults to microseconds; without a
+ * clock every command lands in bucket 0.
+ */
+#ifndef F32_STATS_BUCKETS
+#define F32_STATS_BUCKETS   8
+#endif
+
+/**
+ * Announce the length of multi-block writes with ACMD23 so the card can
+ * erase the blocks ahead of the data. Set to 0 for cards that mishandle
+ * ACMD23.
+ */
+#ifndef F32_PRE_ERASE
+#define F32_PRE_ERASE       1
+#endif
+
+/**
+ * Number of sectors in the write-behind queue, 0 to write synchronously.
+ * Queued sectors reach the card from f32_poll while the card is idle, or
+ * when the queue is full or synced. Each one costs a sector of RAM.
+ * f32_poll leaves the queue alone until it holds F32_WB_HIGH_WATER sectors,
+ * giving rewrites and neighbouring sectors a chance to merge. With
+ * F32_WB_DROP set, a write to a full queue fails instead of waiting on
+ * the card.
+ */
+#ifndef F32_WRITE_BEHIND
+#define F32_WRITE_BEHIND    0
+#endif
+
+#ifndef F32_WB_HIGH_WATER
+#define F32_WB_HIGH_WATER   ((F32_WRITE_BEHIND + 1)/2)
+#endif
+
+#ifndef F32_WB_DROP
+#define F32_WB_DROP         0
+#endif
+
+/**
+ * Give every open file its own sector buffer, at the cost of a sector of
+ * RAM per handle. Partial writes collect there and reach the card once the
+ * file moves on to another sector or is synced, so files written in turn
+ * don't keep reloading their sectors through the shared buffer. Unsynced
+ * data is only visible through the handle that wrote it.
+ */
+#ifndef F32_HANDLE_BUFFERS
+#define F32_HANDLE_BUFFERS  0
+#endif
+
+/**
+ * Number of recent directory lookups remembered, so reopening a file
+ * doesn't rescan its directory. Each entry costs 30 bytes of RAM. With
+ * F32_NAME_CACHE_NEGATIVE set, names that were not found are remembered
+ * too, until the file is created.
+ */
+#ifndef F32_NAME_CACHE
+#ifdef DESKTOP
+#define F32_NAME_CACHE      8
+#else
+#define F32_NAME_CACHE      0
+#endif
+#endif
+
+#ifndef F32_NAME_CACHE_NEGATIVE
+#define F32_NAME_CACHE_NEGATIVE 1
+#endif
+
+/**
+ * Number of directory paths remembered with their first cluster, so
+ * opening a file in a deep directory resolves its path in one step. Paths
+ * longer than F32_PATH_CACHE_LEN characters are not cached. Each entry
+ * costs F32_PATH_CACHE_LEN + 5 bytes of RAM.
+ */
+#ifndef F32_PATH_CACHE
+#ifdef DESKTOP
+#define F32_PATH_CACHE      4
+#else
+#define F32_PATH_CACHE      0
+#endif
+#endif
+
+#ifndef F32_PATH_CACHE_LEN
+#define F32_PATH_CACHE_LEN  32
+#endif
+
+/**
+ * VFAT long file names. Names that don't fit 8.3 are looked up by their
+ * long name and created with one, next to a generated NAME~N.EXT alias.
+ * Lookups compare the name a directory entry at a time, so long names
+ * cost directory entries but no extra RAM. Long names are ASCII only.
+ */
+#ifndef F32_LFN
+#define F32_LFN             1
+#endif
+
+/**
+ * Bytes of RAM for the directory index, 0 to always scan directories. A
+ * directory that takes F32_DIR_INDEX_SECTORS or more sector reads to
+ * search gets its short names hashed into the index, after which finding
+ * a name or a free entry in it reads one directory sector. One directory
+ * is indexed at a time, at 4 bytes per slot, and a directory with more
+ * names than 3/4 of the slots keeps being scanned.
+ */
+#ifndef F32_DIR_INDEX
+#ifdef DESKTOP
+#define F32_DIR_INDEX       16384
+#else
+#define F32_DIR_INDEX       0
+#endif
+#endif
+
+#ifndef F32_DIR_INDEX_SECTORS
+#define F32_DIR_INDEX_SECTORS   4
+#endif
+
+/**
+ * Expensive scans another directory needs before it takes the index over
+ * from the indexed one. A directory that turned out too large for the
+ * index is not tried again until the next mount.
+ */
+#ifndef F32_DIR_INDEX_SWITCH
+#define F32_DIR_INDEX_SWITCH    4
+#endif
+
 #define SEC_SIZE        512
 #define F32_READ_ONLY   0
 
 #define F32_EOF         0xFFFF
 
+#define F32_FILE_DIRTY  0x01 /* directory entry is out of date */
+#define F32_FILE_BUF_DIRTY  0x02 /* handle buffer holds data the card doesn't */
+
 /**
  * Basic struct describing a FAT32 sector
  */
@@ -23,6 +194,51 @@ typedef struct f32_sector {
     uint8_t data[SEC_SIZE];
 } f32_sector;
 
+/**
+ * Run of contiguous clusters in a file
+ */
+typedef struct {
+    uint32_t file_cluster; /* index of the run's first cluster within the file */
+    uint32_t cluster; /* first data cluster of the run */
+    uint32_t length; /* number of clusters in the run */
+} f32_extent;
+
+/**
+ * Sector classes used by the I/O statistics
+ */
+#define F32_CLASS_BOOT  0 /* reserved region: boot sector, FSInfo */
+#define F32_CLASS_FAT   1
+#define F32_CLASS_DIR   2
+#define F32_CLASS_DATA  3
+#define F32_CLASSES     4
+
+/**
+ * Block I/O statistics, indexed by sector class. Requests are what the
+ * file system asked for, card traffic is what reached the card after the
+ * block cache.
+ */
+typedef struct {
+    uint32_t reads[F32_CLASSES]; /* sectors read by the file system */
+    uint32_t writes[F32_CLASSES]; /* sectors written by the file system */
+    uint32_t card_reads[F32_CLASSES]; /* sectors read from the card */
+    uint32_t card_writes[F32_CLASSES]; /* sectors written to the card */
+    uint32_t read_cmds; /* card read commands, a multi-block read counts once */
+    uint32_t write_cmds; /* card write commands */
+    uint32_t latency[F32_STATS_BUCKETS]; /* card commands by duration */
+} f32_stats;
+
+/**
+ * Write-behind queue statistics
+ */
+typedef struct {
+    uint32_t queued; /* sectors added to the queue */
+    uint32_t merged; /* writes absorbed by a sector already queued */
+    uint32_t written; /* sectors written to the card */
+    uint32_t blocked; /* writes that waited for the queue to drain */
+    uint32_t dropped; /* writes refused by a full queue */
+    uint8_t max_fill; /* most sectors queued at once */
+} f32_wb_stats;
+
 /**
  * FAT32 file info
  */
@@ -34,16 +250,113 @@ typedef struct {
     uint32_t file_offset;
     uint32_t file_entry_sector;
     uint16_t file_entry_offset;
+    uint8_t flags;
+    uint32_t unsynced_bytes; /* bytes written since the last sync */
+    uint32_t dirty_time; /* time of day in seconds of the first unsynced write */
+    uint8_t extent_count;
+    f32_extent extents[F32_EXTENTS]; /* cluster runs from the start of the file */
+#if F32_HANDLE_BUFFERS
+    uint32_t buffered_sector; /* sector held in sec, 0 if none */
+    f32_sector sec;
+#endif
 } f32_file;
 
+/**
+ * Directory entry as seen by f32_readdir
+ */
+typedef struct {
+    char name[13]; /* 8.3 name with its dot, NUL terminated */
+    uint8_t attr;
+    uint32_t size;
+    uint32_t cluster; /* first data cluster */
+    uint16_t crt_date;
+    uint16_t crt_time;
+    uint16_t wrt_date;
+    uint16_t wrt_time;
+} f32_dirent;
+
+/**
+ * Open directory. Only the position is kept here; entries are read a
+ * sector at a time into the buffer given to f32_mount, which must be left
+ * alone between f32_readdir calls.
+ */
+typedef struct {
+    uint32_t cluster; /* cluster of the next entry */
+    uint16_t index; /* next entry within the cluster */
+} f32_dir;
+
+struct io_device;
+
+/**
+ * Mount the volume on the build's default block device: the SD card, or
+ * test_mmc.img on the desktop build
+ */
 uint8_t f32_mount(f32_sector * tmp);
+
+/**
+ * Mount the volume on the given block device
+ */
+uint8_t f32_mount_dev(const struct io_device * dev, f32_sector * tmp);
 f32_file * f32_open(const char * __restrict__ fname, const char * __restrict__ modes);
 uint8_t f32_close(f32_file * fd);
+uint8_t f32_sync(f32_file * fd);
+
+/**
+ * Read the next sector of the file into the buffer given to f32_mount
+ *
+ * @return Number of bytes read, F32_EOF at the end of the file
+ */
 uint16_t f32_read(f32_file * fd);
 uint8_t f32_umount(void);
 uint8_t f32_seek(f32_file * fd, uint32_t offset);
 uint8_t f32_write_sec(f32_file * fd);
 
+/**
+ * Reserve a contiguous run of clusters so the file can grow to bytes
+ * without further allocation. The file size is left untouched.
+ */
+uint8_t f32_prealloc(f32_file * fd, uint32_t bytes);
+
+/**
+ * Write queued sectors while the card is idle. Call it from the main loop,
+ * or when a timer tick flag is seen, but not from an interrupt handler.
+ * Does nothing without write-behind.
+ */
+uint8_t f32_poll(void);
+
+#if F32_WRITE_BEHIND
+/**
+ * Copy the write-behind statistics into stats (if not NULL) and clear them
+ * if reset is set
+ */
+uint8_t f32_get_wb_stats(f32_wb_stats * stats, uint8_t reset);
+#endif
+
+#if F32_STATS
+/**
+ * Copy the I/O statistics into stats (if not NULL) and clear them if
+ * reset is set. Statistics survive remounts.
+ */
+uint8_t f32_get_stats(f32_stats * stats, uint8_t reset);
+#endif
+
+/**
+ * Open a directory for f32_readdir. "", "/" and 0 are the root directory.
+ */
+uint8_t f32_opendir(f32_dir * dir, const char * path);
+void f32_opendir_cluster(f32_dir * dir, uint32_t dir_cluster);
+
+/**
+ * Read the next entry of a directory. Deleted entries and long name parts
+ * are skipped.
+ *
+ * @return 0 on success, 1 at the end of the directory or on error
+ */
+uint8_t f32_readdir(f32_dir * dir, f32_dirent * en);
+
+/**
+ * Print the entries of a directory
+ */
 void f32_ls(uint32_t dir_cluster);
 uint8_t read_sector(uint32_t addr, f32_sector * buf);
 uint8_t write_sector(uint32_t addr, const f32_sector * buf);
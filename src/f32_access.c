@@ -2,6 +2,7 @@
 #include "f32.h"
 #include "sdcard.h"
 #include <stdio.h>
+#include <string.h>
 
 #define PRINT_WIDTH     32
 void f32_print_sector(uint32_t addr, const uint8_t * buf) {
@@ -23,12 +24,519 @@ void f32_print_sector(uint32_t addr, const uint8_t * buf) {
     printf("\n\n");
 }
 
-inline uint8_t io_init() {
-    return sd_init();
+#if F32_STATS
+#if !defined(F32_STATS_CLOCK) && defined(DESKTOP)
+#include <time.h>
+
+static uint32_t io_stats_clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000UL + ts.tv_nsec/1000;
+}
+
+#define F32_STATS_CLOCK()   io_stats_clock_us()
+#endif
+
+#define IO_CLASS_AUTO   0xFF
+
+static f32_stats stats;
+static uint32_t stats_fat_start;
+static uint32_t stats_data_start;
+static uint8_t stats_next = IO_CLASS_AUTO;
+
+void io_stats_layout(uint32_t fat_start, uint32_t data_start) {
+    stats_fat_start = fat_start;
+    stats_data_start = data_start;
+}
+
+void io_stats_next(uint8_t cls) {
+    stats_next = cls;
+}
+
+static uint8_t io_stats_class(uint32_t addr) {
+    uint8_t cls = stats_next;
+    if(cls != IO_CLASS_AUTO) {
+        stats_next = IO_CLASS_AUTO;
+        return cls;
+    }
+
+    if(addr < stats_fat_start) {
+        return F32_CLASS_BOOT;
+    }
+
+    return (addr < stats_data_start) ? F32_CLASS_FAT : F32_CLASS_DATA;
+}
+
+static inline uint32_t io_stats_clock(void) {
+#ifdef F32_STATS_CLOCK
+    return F32_STATS_CLOCK();
+#else
+    return 0;
+#endif
+}
+
+static void io_stats_command(uint32_t * cmds, uint32_t start) {
+    uint32_t ticks = io_stats_clock() - start;
+    uint8_t n = 0;
+    while((n < F32_STATS_BUCKETS - 1) && (ticks >= 4)) {
+        ticks >>= 2;
+        n++;
+    }
+
+    (*cmds)++;
+    stats.latency[n]++;
+}
+
+uint8_t f32_get_stats(f32_stats * out, uint8_t reset) {
+    if(out != NULL) {
+        memcpy(out, &stats, sizeof(stats));
+    }
+
+    if(reset) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    return 0;
+}
+
+#define IO_STATS_COUNT(field, cls, n)   (stats.field[cls] += (n))
+#else
+#define io_stats_class(addr)            0
+#define IO_STATS_COUNT(field, cls, n)
+#endif
+
+static const io_device * dev;
+
+#if F32_WRITE_BEHIND
+/**
+ * Write-behind queue. Sectors wait here in the order they were written;
+ * writing a sector that is already queued replaces its data in place.
+ */
+typedef struct {
+    uint32_t addr;
+    uint8_t cls; /* sector class for the statistics */
+    uint8_t data[SEC_SIZE];
+} io_wb_entry;
+
+static io_wb_entry wb[F32_WRITE_BEHIND];
+static uint8_t wb_head; /* oldest queued sector */
+static uint8_t wb_count;
+static uint8_t wb_flushing; /* a full queue waits even with F32_WB_DROP */
+static f32_wb_stats wb_stats;
+
+#define IO_WB_AT(n)     (&wb[(wb_head + (n)) % F32_WRITE_BEHIND])
+#endif
+
+#if F32_CACHE_SECTORS < 2
+/**
+ * Multi-block read left open by io_read_stream. stream_end is one past the
+ * last sector of the run it was started for, 0 while no read is open.
+ */
+static uint32_t stream_next;
+static uint32_t stream_end;
+
+static uint8_t io_stream_stop(void) {
+    if(stream_end == 0) {
+        return 0;
+    }
+
+    stream_end = 0;
+    return dev->stream_stop();
+}
+#else
+#define io_stream_stop()    0
+#endif
+
+/**
+ * Card access. Every command the device sees goes through here so the
+ * statistics can time it; sectors of multi-block transfers are counted by
+ * the callers' handlers. The multi-block calls need the device to support
+ * them, callers fall back to single blocks otherwise. A read left open by
+ * io_read_stream is ended before the card is given another command.
+ */
+static uint8_t io_card_read(uint32_t addr, uint8_t * buf, uint8_t cls) {
+#if F32_WRITE_BEHIND
+    // queued data is newer than the card's
+    for(uint8_t n = 0; n < wb_count; n++) {
+        if(IO_WB_AT(n)->addr == addr) {
+            memcpy(buf, IO_WB_AT(n)->data, SEC_SIZE);
+            return 0;
+        }
+    }
+#endif
+
+    if(io_stream_stop()) {
+        return 1;
+    }
+
+#if F32_STATS
+    uint32_t start = io_stats_clock();
+    uint8_t res = dev->read_block(addr, buf);
+    io_stats_command(&stats.read_cmds, start);
+    stats.card_reads[cls]++;
+    return res;
+#else
+    (void)cls;
+    return dev->read_block(addr, buf);
+#endif
+}
+
+static uint8_t io_card_write(uint32_t addr, const uint8_t * buf, uint8_t cls) {
+    if(io_stream_stop()) {
+        return 1;
+    }
+
+#if F32_STATS
+    uint32_t start = io_stats_clock();
+    uint8_t res = dev->write_block(addr, buf);
+    io_stats_command(&stats.write_cmds, start);
+    stats.card_writes[cls]++;
+    return res;
+#else
+    (void)cls;
+    return dev->write_block(addr, buf);
+#endif
+}
+
+#if F32_CACHE_SECTORS > 1
+static uint8_t io_card_read_blocks(uint32_t addr, uint16_t count, uint8_t * buf, io_read_handler handler, void * ctx) {
+#if F32_STATS
+    uint32_t start = io_stats_clock();
+    uint8_t res = dev->read_blocks(addr, count, buf, handler, ctx);
+    io_stats_command(&stats.read_cmds, start);
+    return res;
+#else
+    return dev->read_blocks(addr, count, buf, handler, ctx);
+#endif
+}
+#endif
+
+static uint8_t io_card_write_blocks(uint32_t addr, uint16_t count, const uint8_t * buf, io_write_handler handler, void * ctx) {
+    if(io_stream_stop()) {
+        return 1;
+    }
+
+#if F32_STATS
+    uint32_t start = io_stats_clock();
+    uint8_t res = dev->write_blocks(addr, count, buf, handler, ctx, F32_PRE_ERASE);
+    io_stats_command(&stats.write_cmds, start);
+    return res;
+#else
+    return dev->write_blocks(addr, count, buf, handler, ctx, F32_PRE_ERASE);
+#endif
+}
+
+#if F32_WRITE_BEHIND
+static io_wb_entry * io_wb_find(uint32_t addr) {
+    for(uint8_t n = 0; n < wb_count; n++) {
+        if(IO_WB_AT(n)->addr == addr) {
+            return IO_WB_AT(n);
+        }
+    }
+
+    return NULL;
+}
+
+#if F32_CACHE_SECTORS > 1
+static uint8_t io_wb_overlaps(uint32_t addr, uint16_t count) {
+    for(uint8_t n = 0; n < wb_count; n++) {
+        if(IO_WB_AT(n)->addr - addr < count) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+static const uint8_t * io_wb_drain_next(uint32_t addr, const uint8_t * data, void * ctx) {
+    (void)addr;
+    (void)data;
+
+    uint8_t * n = (uint8_t*)ctx;
+    IO_STATS_COUNT(card_writes, IO_WB_AT(*n)->cls, 1);
+    (*n)++;
+
+    return IO_WB_AT(*n)->data;
+}
+
+/**
+ * Write the oldest queued sector, together with the queued sectors that
+ * follow it on the card, with one multi-block write
+ */
+static uint8_t io_wb_drain(void) {
+    io_wb_entry * en = IO_WB_AT(0);
+    uint8_t count = 1;
+    while((count < wb_count) && (IO_WB_AT(count)->addr == en->addr + count)) {
+        count++;
+    }
+
+    if((count > 1) && (dev->write_blocks != NULL)) {
+        uint8_t n = 0;
+        if(io_card_write_blocks(en->addr, count, en->data, io_wb_drain_next, &n)) {
+            return 1;
+        }
+    } else {
+        count = 1;
+        if(io_card_write(en->addr, en->data, en->cls)) {
+            return 1;
+        }
+    }
+
+    wb_head = (wb_head + count) % F32_WRITE_BEHIND;
+    wb_count -= count;
+    wb_stats.written += count;
+    return 0;
+}
+
+static uint8_t io_wb_queue(uint32_t addr, const uint8_t * buf, uint8_t cls) {
+    io_wb_entry * en = io_wb_find(addr);
+    if(en != NULL) {
+        memcpy(en->data, buf, SEC_SIZE);
+        wb_stats.merged++;
+        return 0;
+    }
+
+    if(wb_count == F32_WRITE_BEHIND) {
+        if(F32_WB_DROP && !wb_flushing) {
+            wb_stats.dropped++;
+            return 1;
+        }
+
+        wb_stats.blocked++;
+        if(io_wb_drain()) {
+            return 1;
+        }
+    }
+
+    en = IO_WB_AT(wb_count++);
+    en->addr = addr;
+    en->cls = cls;
+    memcpy(en->data, buf, SEC_SIZE);
+
+    wb_stats.queued++;
+    if(wb_count > wb_stats.max_fill) {
+        wb_stats.max_fill = wb_count;
+    }
+
+    return 0;
+}
+
+uint8_t f32_get_wb_stats(f32_wb_stats * out, uint8_t reset) {
+    if(out != NULL) {
+        memcpy(out, &wb_stats, sizeof(wb_stats));
+    }
+
+    if(reset) {
+        memset(&wb_stats, 0, sizeof(wb_stats));
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * Sector on its way to the card, through the write-behind queue if enabled
+ */
+static inline uint8_t io_write_out(uint32_t addr, const uint8_t * buf, uint8_t cls) {
+#if F32_WRITE_BEHIND
+    return io_wb_queue(addr, buf, cls);
+#else
+    return io_card_write(addr, buf, cls);
+#endif
+}
+
+#if F32_CACHE_SECTORS
+#define IO_CACHE_VALID      0x01
+#define IO_CACHE_DIRTY      0x02
+#define IO_CACHE_CLASS(X)   ((X) >> 4) /* sector class for the statistics */
+
+/**
+ * Block cache entry
+ */
+typedef struct {
+    uint32_t addr; /* sector held by this entry */
+    uint16_t stamp; /* last access, used for LRU replacement */
+    uint8_t flags;
+    uint8_t pins; /* entry cannot be evicted while non-zero */
+    uint8_t data[SEC_SIZE];
+} io_cache_entry;
+
+static io_cache_entry cache[F32_CACHE_SECTORS];
+static uint16_t cache_tick;
+
+static io_cache_entry * io_cache_find(uint32_t addr) {
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        if((cache[i].flags & IO_CACHE_VALID) && (cache[i].addr == addr)) {
+            return &cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+static io_cache_entry * io_cache_lookup(uint32_t addr) {
+    io_cache_entry * en = io_cache_find(addr);
+    if(en != NULL) {
+        en->stamp = ++cache_tick;
+    }
+
+    return en;
+}
+
+static const uint8_t * io_cache_writeback_next(uint32_t addr, const uint8_t * data, void * ctx) {
+    (void)data;
+    (void)ctx;
+
+    io_cache_entry * done = io_cache_find(addr);
+    done->flags &= ~IO_CACHE_DIRTY;
+    IO_STATS_COUNT(card_writes, IO_CACHE_CLASS(done->flags), 1);
+
+    io_cache_entry * en = io_cache_find(addr + 1);
+    return (en != NULL) ? en->data : NULL;
+}
+
+/**
+ * Write back a dirty entry together with any dirty sectors directly
+ * following it, so sequential data leaves the cache as one multi-block write
+ */
+static uint8_t io_cache_writeback(io_cache_entry * en) {
+    if(!(en->flags & IO_CACHE_DIRTY)) {
+        return 0;
+    }
+
+    uint16_t count = 1;
+    io_cache_entry * next;
+    while(((next = io_cache_find(en->addr + count)) != NULL) && (next->flags & IO_CACHE_DIRTY)) {
+        count++;
+    }
+
+    // queued sectors are merged into runs again when they drain
+    if((count > 1) && (dev->write_blocks != NULL) && !F32_WRITE_BEHIND) {
+        return io_card_write_blocks(en->addr, count, en->data, io_cache_writeback_next, NULL);
+    }
+
+    if(io_write_out(en->addr, en->data, IO_CACHE_CLASS(en->flags))) {
+        return 1;
+    }
+    en->flags &= ~IO_CACHE_DIRTY;
+
+    return 0;
+}
+
+/**
+ * Find the least recently used entry that is not pinned and write it back
+ * so it can be reused. Returns NULL if every entry is pinned.
+ */
+static io_cache_entry * io_cache_victim(void) {
+    io_cache_entry * victim = NULL;
+    uint16_t oldest = 0;
+
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        if(cache[i].pins) {
+            continue;
+        }
+
+        if(!(cache[i].flags & IO_CACHE_VALID)) {
+            victim = &cache[i];
+            break;
+        }
+
+        uint16_t age = cache_tick - cache[i].stamp;
+        if((victim == NULL) || (age > oldest)) {
+            victim = &cache[i];
+            oldest = age;
+        }
+    }
+
+    if(victim == NULL) {
+        return NULL;
+    }
+
+    if(io_cache_writeback(victim)) {
+        return NULL;
+    }
+
+    victim->flags = 0;
+    victim->stamp = ++cache_tick;
+    return victim;
+}
+
+static io_cache_entry * io_cache_load(uint32_t addr, uint8_t cls) {
+    io_cache_entry * en = io_cache_lookup(addr);
+    if(en != NULL) {
+        return en;
+    }
+
+    en = io_cache_victim();
+    if(en == NULL) {
+        return NULL;
+    }
+
+    if(io_card_read(addr, en->data, cls)) {
+        return NULL;
+    }
+
+    f32_print_sector(addr, en->data);
+    en->addr = addr;
+    en->flags = IO_CACHE_VALID | (cls << 4);
+    return en;
+}
+
+#if F32_CACHE_SECTORS > 1
+typedef struct {
+    io_cache_entry * slots[F32_CACHE_SECTORS];
+    uint8_t next;
+} io_read_ahead_ctx;
+
+static uint8_t * io_read_ahead_fill(uint32_t addr, uint8_t * data, void * ctx) {
+    io_read_ahead_ctx * ra = (io_read_ahead_ctx*)ctx;
+    io_cache_entry * en = ra->slots[ra->next++];
+
+    f32_print_sector(addr, data);
+    IO_STATS_COUNT(card_reads, F32_CLASS_DATA, 1);
+    en->addr = addr;
+    en->flags = IO_CACHE_VALID | (F32_CLASS_DATA << 4);
+    en->stamp = ++cache_tick;
+    en->pins--;
+
+    return ra->slots[ra->next]->data;
+}
+#endif
+#endif
+
+uint8_t io_init(const io_device * device) {
+#if F32_CACHE_SECTORS
+    memset(cache, 0, sizeof(cache));
+#endif
+    // everything counts as boot sectors until the volume is known
+    io_stats_layout(UINT32_MAX, UINT32_MAX);
+
+#if F32_WRITE_BEHIND
+    wb_head = 0;
+    wb_count = 0;
+#endif
+#if F32_CACHE_SECTORS < 2
+    stream_end = 0;
+#endif
+
+    dev = device;
+    return dev->init();
 }
 
 inline uint8_t io_read_block(uint32_t addr, uint8_t * buf) {
-    if(sd_read_block(addr, buf)) {
+    uint8_t cls = io_stats_class(addr);
+    IO_STATS_COUNT(reads, cls, 1);
+
+#if F32_CACHE_SECTORS
+    io_cache_entry * en = io_cache_load(addr, cls);
+    if(en != NULL) {
+        memcpy(buf, en->data, SEC_SIZE);
+        return 0;
+    }
+#endif
+
+    if(io_card_read(addr, buf, cls)) {
         return 1;
     }
 
@@ -37,7 +545,24 @@ inline uint8_t io_read_block(uint32_t addr, uint8_t * buf) {
 }
 
 inline uint8_t io_write_block(uint32_t addr, const uint8_t *buf) {
-    if(sd_write_block(addr, buf)) {
+    uint8_t cls = io_stats_class(addr);
+    IO_STATS_COUNT(writes, cls, 1);
+
+#if F32_CACHE_SECTORS
+    io_cache_entry * en = io_cache_lookup(addr);
+    if(en == NULL) {
+        en = io_cache_victim();
+    }
+
+    if(en != NULL) {
+        memcpy(en->data, buf, SEC_SIZE);
+        en->addr = addr;
+        en->flags = IO_CACHE_VALID | IO_CACHE_DIRTY | (cls << 4);
+        return 0;
+    }
+#endif
+
+    if(io_write_out(addr, buf, cls)) {
         return 1;
     }
 
@@ -45,13 +570,307 @@ inline uint8_t io_write_block(uint32_t addr, const uint8_t *buf) {
     return 0;
 }
 
+uint8_t io_write_blocks(uint32_t addr, uint16_t count, const uint8_t * buf) {
+    IO_STATS_COUNT(writes, F32_CLASS_DATA, count);
+    if((dev->write_blocks != NULL) && !F32_WRITE_BEHIND) {
+        if(io_card_write_blocks(addr, count, buf, NULL, NULL)) {
+            return 1;
+        }
+        IO_STATS_COUNT(card_writes, F32_CLASS_DATA, count);
+    } else {
+        for(uint16_t n = 0; n < count; n++) {
+            if(io_write_out(addr + n, &buf[n*SEC_SIZE], F32_CLASS_DATA)) {
+                return 1;
+            }
+        }
+    }
+
+#if F32_CACHE_SECTORS
+    // keep cached copies in step with the card
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        if((cache[i].flags & IO_CACHE_VALID) && (cache[i].addr - addr < count)) {
+            memcpy(cache[i].data, &buf[(cache[i].addr - addr)*SEC_SIZE], SEC_SIZE);
+            cache[i].flags &= ~IO_CACHE_DIRTY;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+uint8_t io_read_ahead(uint32_t addr, uint16_t count) {
+#if F32_CACHE_SECTORS > 1
+    io_read_ahead_ctx ra;
+    uint8_t n = 0;
+
+    // leave the other half of the cache to FAT and directory sectors
+    if(count > F32_CACHE_SECTORS/2) {
+        count = F32_CACHE_SECTORS/2;
+    }
+
+    if((count < 2) || (dev->read_blocks == NULL) || (io_cache_lookup(addr) != NULL)) {
+        return 0;
+    }
+
+#if F32_WRITE_BEHIND
+    // the card's copy of a queued sector is stale
+    if(io_wb_overlaps(addr, count)) {
+        return 0;
+    }
+#endif
+
+    // claim every slot up front, write-backs can't happen mid-transfer
+    for(; n < count; n++) {
+        if(((n > 0) && io_cache_lookup(addr + n)) || ((ra.slots[n] = io_cache_victim()) == NULL)) {
+            break;
+        }
+        ra.slots[n]->pins++;
+    }
+
+    // the extra slot is only handed back after the final block
+    ra.slots[n] = ra.slots[0];
+    ra.next = 0;
+
+    if((n < 2) || io_card_read_blocks(addr, n, ra.slots[0]->data, io_read_ahead_fill, &ra)) {
+        // release whatever the transfer didn't fill
+        for(uint8_t i = ra.next; i < n; i++) {
+            ra.slots[i]->pins--;
+        }
+        return 0;
+    }
+#else
+    (void)addr;
+    (void)count;
+#endif
+
+    return 0;
+}
+
+uint8_t io_read_stream(uint32_t addr, uint16_t count, uint8_t * buf) {
+#if F32_CACHE_SECTORS < 2
+#if F32_CACHE_SECTORS
+    if(io_cache_lookup(addr) != NULL) {
+        return io_read_block(addr, buf);
+    }
+#endif
+#if F32_WRITE_BEHIND
+    // the card's copy of a queued sector is stale
+    if(io_wb_find(addr) != NULL) {
+        return io_read_block(addr, buf);
+    }
+#endif
+
+    if((stream_end == 0) || (addr != stream_next)) {
+        // a single sector isn't worth the extra STOP_TRANSMISSION
+        if((count < 2) || (dev->stream_start == NULL)) {
+            return io_read_block(addr, buf);
+        }
+
+        if(io_stream_stop()) {
+            return 1;
+        }
+
+#if F32_STATS
+        uint32_t start = io_stats_clock();
+        uint8_t res = dev->stream_start(addr);
+        io_stats_command(&stats.read_cmds, start);
+        if(res) {
+            return 1;
+        }
+#else
+        if(dev->stream_start(addr)) {
+            return 1;
+        }
+#endif
+
+        stream_next = addr;
+        stream_end = addr + count;
+    }
+
+#if F32_STATS
+    uint8_t cls = io_stats_class(addr);
+    stats.reads[cls]++;
+    stats.card_reads[cls]++;
+#endif
+
+    if(dev->stream_read(buf)) {
+        io_stream_stop();
+        return 1;
+    }
+
+    // the card would go on sending past the end of the run
+    if((++stream_next == stream_end) && io_stream_stop()) {
+        return 1;
+    }
+
+    f32_print_sector(addr, buf);
+    return 0;
+#else
+    // the run has been prefetched by io_read_ahead
+    (void)count;
+    return io_read_block(addr, buf);
+#endif
+}
+
+static uint8_t io_writeback_all(void) {
+#if F32_CACHE_SECTORS
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        // start at the first sector of each dirty run
+        io_cache_entry * prev = io_cache_find(cache[i].addr - 1);
+        if((prev != NULL) && (prev->flags & IO_CACHE_DIRTY)) {
+            continue;
+        }
+
+        if(io_cache_writeback(&cache[i])) {
+            return 1;
+        }
+    }
+
+    // anything left is part of a run whose start was written back above
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        if(io_cache_writeback(&cache[i])) {
+            return 1;
+        }
+    }
+#endif
+
+#if F32_WRITE_BEHIND
+    while(wb_count) {
+        if(io_wb_drain()) {
+            return 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+uint8_t io_flush(void) {
+#if F32_WRITE_BEHIND
+    // nothing may be dropped on the way out
+    wb_flushing = 1;
+    uint8_t res = io_writeback_all();
+    wb_flushing = 0;
+    if(res) {
+        return 1;
+    }
+#else
+    if(io_writeback_all()) {
+        return 1;
+    }
+#endif
+
+    if(io_stream_stop()) {
+        return 1;
+    }
+
+    return (dev->sync != NULL) ? dev->sync() : 0;
+}
+
+uint8_t io_poll(void) {
+#if F32_WRITE_BEHIND
+    while(wb_count && (wb_count >= F32_WB_HIGH_WATER)) {
+        if(io_stream_stop()) {
+            return 1;
+        }
+
+        if((dev->poll != NULL) && dev->poll()) {
+            break;
+        }
+
+        if(io_wb_drain()) {
+            return 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+uint8_t io_trim(uint32_t addr, uint32_t count) {
+#if F32_WRITE_BEHIND
+    // queued sectors can't be taken out of the middle, let them land first
+    while(wb_count) {
+        if(io_wb_drain()) {
+            return 1;
+        }
+    }
+#endif
+
+#if F32_CACHE_SECTORS
+    // the data is going away, there is nothing left to write back
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        if((cache[i].flags & IO_CACHE_VALID) && (cache[i].addr - addr < count) && !cache[i].pins) {
+            cache[i].flags = 0;
+        }
+    }
+#endif
+
+    if(io_stream_stop()) {
+        return 1;
+    }
+
+    return (dev->trim != NULL) ? dev->trim(addr, count) : 0;
+}
+
+uint32_t io_sector_count(void) {
+    return (dev->sector_count != NULL) ? dev->sector_count() : 0;
+}
+
+#ifndef DESKTOP
+const io_device io_sd_device = {
+    .init = sd_init,
+    .read_block = sd_read_block,
+    .write_block = sd_write_block,
+    .read_blocks = sd_read_blocks,
+    .write_blocks = sd_write_blocks,
+    .sync = sd_sync,
+    .poll = sd_poll,
+    .sector_count = sd_sector_count,
+    .stream_start = sd_stream_start,
+    .stream_read = sd_stream_read,
+    .stream_stop = sd_stream_stop,
+};
+#endif
+
+uint8_t io_pin_block(uint32_t addr) {
+#if F32_CACHE_SECTORS
+    io_cache_entry * en = io_cache_load(addr, io_stats_class(addr));
+    if(en != NULL) {
+        en->pins++;
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+void io_unpin_block(uint32_t addr) {
+#if F32_CACHE_SECTORS
+    for(uint8_t i = 0; i < F32_CACHE_SECTORS; i++) {
+        if((cache[i].flags & IO_CACHE_VALID) && (cache[i].addr == addr) && cache[i].pins) {
+            cache[i].pins--;
+            return;
+        }
+    }
+#endif
+}
+
 #ifdef DESKTOP
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static FILE * in;
+io_desktop_stats io_dev_stats;
 
-FILE * in;
+static uint8_t io_image_init(void) {
+    // flush anything written through a previous mount
+    if(in != NULL) {
+        fclose(in);
+    }
 
-uint8_t sd_init() {
     in = fopen("test_mmc.img", "rb+");
 
     if(in == NULL) {
@@ -62,10 +881,13 @@ uint8_t sd_init() {
 }
 
 
-uint8_t sd_read_block(uint32_t addr, uint8_t * buf) {
+static uint8_t io_image_read_block(uint32_t addr, uint8_t * buf) {
     // printf("\n\nReading sector 0x%08X\n", addr);
     if(in == NULL) return 1;
 
+    io_dev_stats.read_cmds++;
+    io_dev_stats.blocks_read++;
+
     fseek(in, addr*SEC_SIZE, SEEK_SET);
     if(fread(buf, SEC_SIZE, 1, in) == 1) {
         // f32_print_sector(addr, buf);
@@ -75,10 +897,58 @@ uint8_t sd_read_block(uint32_t addr, uint8_t * buf) {
     return 1;
 }
 
-uint8_t sd_write_block(uint32_t addr, const uint8_t *buf) {
+static uint8_t io_image_read_blocks(uint32_t addr, uint16_t count, uint8_t *buf, io_read_handler handler, void *ctx) {
+    if(in == NULL) return 1;
+
+    io_dev_stats.read_cmds++;
+
+    fseek(in, addr*SEC_SIZE, SEEK_SET);
+    for(uint16_t n = 0; n < count; n++) {
+        if(fread(buf, SEC_SIZE, 1, in) != 1) {
+            return 1;
+        }
+        io_dev_stats.blocks_read++;
+
+        if(handler == NULL) {
+            buf += SEC_SIZE;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t io_image_write_blocks(uint32_t addr, uint16_t count, const uint8_t *buf, io_write_handler handler, void *ctx, uint8_t pre_erase) {
+    (void)pre_erase;
+    if(in == NULL) return 1;
+
+    io_dev_stats.write_cmds++;
+
+    fseek(in, addr*SEC_SIZE, SEEK_SET);
+    for(uint16_t n = 0; n < count; n++) {
+        if(fwrite(buf, SEC_SIZE, 1, in) != 1) {
+            return 1;
+        }
+        io_dev_stats.blocks_written++;
+
+        if(handler == NULL) {
+            buf += SEC_SIZE;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t io_image_write_block(uint32_t addr, const uint8_t *buf) {
     // printf("\n\nWriting sector 0x%08X\n", addr);
     if(in == NULL) return 1;
 
+    io_dev_stats.write_cmds++;
+    io_dev_stats.blocks_written++;
+
     fseek(in, addr*SEC_SIZE, SEEK_SET);
     size_t a;
     if((a = fwrite(buf, SEC_SIZE, 1, in)) == 1) {
@@ -89,4 +959,326 @@ uint8_t sd_write_block(uint32_t addr, const uint8_t *buf) {
 
     return 1;
 }
-#endif
\ No newline at end of file
+static uint8_t io_image_sync(void) {
+    if(in == NULL) return 1;
+
+    return fflush(in) ? 1 : 0;
+}
+
+static uint32_t io_image_sector_count(void) {
+    if(in == NULL) return 0;
+
+    fseek(in, 0, SEEK_END);
+    return ftell(in)/SEC_SIZE;
+}
+
+const io_device io_image_device = {
+    .init = io_image_init,
+    .read_block = io_image_read_block,
+    .write_block = io_image_write_block,
+    .read_blocks = io_image_read_blocks,
+    .write_blocks = io_image_write_blocks,
+    .sync = io_image_sync,
+    .sector_count = io_image_sector_count,
+};
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char * mmap_path = "test_mmc.img";
+static uint8_t * mmap_base;
+static uint32_t mmap_sectors;
+static uint32_t mmap_dirty_start; /* sectors written since the last sync */
+static uint32_t mmap_dirty_end;
+
+void io_mmap_path(const char * path) {
+    mmap_path = path;
+}
+
+static void io_mmap_unmap(void) {
+    if(mmap_base != NULL) {
+        munmap(mmap_base, (size_t)mmap_sectors*SEC_SIZE);
+        mmap_base = NULL;
+        mmap_sectors = 0;
+    }
+}
+
+static uint8_t io_mmap_init(void) {
+    io_mmap_unmap();
+
+    int fd = open(mmap_path, O_RDWR);
+    if(fd < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) || (st.st_size < SEC_SIZE)) {
+        close(fd);
+        return 1;
+    }
+
+    // the mapping keeps the file open
+    mmap_sectors = st.st_size/SEC_SIZE;
+    void * base = mmap(NULL, (size_t)mmap_sectors*SEC_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        mmap_sectors = 0;
+        return 1;
+    }
+
+    mmap_base = base;
+    mmap_dirty_start = mmap_sectors;
+    mmap_dirty_end = 0;
+    return 0;
+}
+
+static uint8_t io_mmap_read_blocks(uint32_t addr, uint16_t count, uint8_t *buf, io_read_handler handler, void *ctx) {
+    if((mmap_base == NULL) || (addr >= mmap_sectors) || (count > mmap_sectors - addr)) return 1;
+
+    io_dev_stats.read_cmds++;
+
+    for(uint16_t n = 0; n < count; n++) {
+        memcpy(buf, &mmap_base[(size_t)(addr + n)*SEC_SIZE], SEC_SIZE);
+        io_dev_stats.blocks_read++;
+
+        if(handler == NULL) {
+            buf += SEC_SIZE;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t io_mmap_write_blocks(uint32_t addr, uint16_t count, const uint8_t *buf, io_write_handler handler, void *ctx, uint8_t pre_erase) {
+    (void)pre_erase;
+    if((mmap_base == NULL) || (addr >= mmap_sectors) || (count > mmap_sectors - addr)) return 1;
+
+    io_dev_stats.write_cmds++;
+
+    if(addr < mmap_dirty_start) {
+        mmap_dirty_start = addr;
+    }
+    if(addr + count > mmap_dirty_end) {
+        mmap_dirty_end = addr + count;
+    }
+
+    for(uint16_t n = 0; n < count; n++) {
+        memcpy(&mmap_base[(size_t)(addr + n)*SEC_SIZE], buf, SEC_SIZE);
+        io_dev_stats.blocks_written++;
+
+        if(handler == NULL) {
+            buf += SEC_SIZE;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t io_mmap_read_block(uint32_t addr, uint8_t * buf) {
+    return io_mmap_read_blocks(addr, 1, buf, NULL, NULL);
+}
+
+static uint8_t io_mmap_write_block(uint32_t addr, const uint8_t * buf) {
+    return io_mmap_write_blocks(addr, 1, buf, NULL, NULL, 0);
+}
+
+static uint8_t io_mmap_sync(void) {
+    if(mmap_base == NULL) return 1;
+    if(mmap_dirty_start >= mmap_dirty_end) return 0;
+
+    // msync wants a page aligned start
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = ((size_t)mmap_dirty_start*SEC_SIZE) & ~(page - 1);
+    size_t end = (size_t)mmap_dirty_end*SEC_SIZE;
+    if(msync(&mmap_base[start], end - start, MS_SYNC)) {
+        return 1;
+    }
+
+    mmap_dirty_start = mmap_sectors;
+    mmap_dirty_end = 0;
+    return 0;
+}
+
+static uint32_t io_mmap_sector_count(void) {
+    return mmap_sectors;
+}
+
+const io_device io_mmap_device = {
+    .init = io_mmap_init,
+    .read_block = io_mmap_read_block,
+    .write_block = io_mmap_write_block,
+    .read_blocks = io_mmap_read_blocks,
+    .write_blocks = io_mmap_write_blocks,
+    .sync = io_mmap_sync,
+    .sector_count = io_mmap_sector_count,
+};
+
+static uint8_t * ram_data;
+static uint32_t ram_sectors;
+static io_ram_model ram_model;
+static uint32_t ram_seed;
+uint64_t io_ram_time_ns;
+
+uint8_t io_ram_load(const char * path) {
+    FILE * img = fopen(path, "rb");
+    if(img == NULL) {
+        return 1;
+    }
+
+    fseek(img, 0, SEEK_END);
+    uint32_t sectors = ftell(img)/SEC_SIZE;
+    fseek(img, 0, SEEK_SET);
+
+    uint8_t * data = realloc(ram_data, (size_t)sectors*SEC_SIZE);
+    if(data == NULL) {
+        fclose(img);
+        return 1;
+    }
+
+    ram_data = data;
+    ram_sectors = sectors;
+    uint8_t res = (fread(ram_data, SEC_SIZE, sectors, img) == sectors) ? 0 : 1;
+    fclose(img);
+    return res;
+}
+
+void io_ram_set_model(const io_ram_model * model) {
+    if(model == NULL) {
+        memset(&ram_model, 0, sizeof(ram_model));
+    } else {
+        ram_model = *model;
+    }
+
+    ram_seed = ram_model.seed;
+    io_ram_time_ns = 0;
+}
+
+/**
+ * Account for time the card would have spent
+ */
+static void io_ram_spend(uint64_t ns) {
+    io_ram_time_ns += ns;
+    if(ram_model.sleep) {
+        struct timespec ts = { ns/1000000000, ns%1000000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * Charge the time a command moving count blocks would take on a card
+ */
+static void io_ram_charge(uint16_t count, uint8_t write) {
+    uint64_t ns = ram_model.command_ns + (uint64_t)ram_model.byte_ns*count*SEC_SIZE;
+
+    // every block written may leave the card busy programming flash
+    for(uint16_t n = 0; write && ram_model.busy_chance && (n < count); n++) {
+        ram_seed = ram_seed*1103515245 + 12345;
+        if(((ram_seed >> 8) % ram_model.busy_chance) == 0) {
+            ram_seed = ram_seed*1103515245 + 12345;
+            ns += (uint64_t)ram_model.busy_max_us*1000/2 + ((uint64_t)(ram_seed >> 8) % (ram_model.busy_max_us/2 + 1))*1000;
+        }
+    }
+
+    io_ram_spend(ns);
+}
+
+static uint8_t io_ram_init(void) {
+    return (ram_data == NULL) ? 1 : 0;
+}
+
+static uint8_t io_ram_read_blocks(uint32_t addr, uint16_t count, uint8_t *buf, io_read_handler handler, void *ctx) {
+    if((ram_data == NULL) || (addr >= ram_sectors) || (count > ram_sectors - addr)) return 1;
+
+    io_dev_stats.read_cmds++;
+    io_ram_charge(count, 0);
+
+    for(uint16_t n = 0; n < count; n++) {
+        memcpy(buf, &ram_data[(size_t)(addr + n)*SEC_SIZE], SEC_SIZE);
+        io_dev_stats.blocks_read++;
+
+        if(handler == NULL) {
+            buf += SEC_SIZE;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t io_ram_write_blocks(uint32_t addr, uint16_t count, const uint8_t *buf, io_write_handler handler, void *ctx, uint8_t pre_erase) {
+    (void)pre_erase;
+    if((ram_data == NULL) || (addr >= ram_sectors) || (count > ram_sectors - addr)) return 1;
+
+    io_dev_stats.write_cmds++;
+    io_ram_charge(count, 1);
+
+    for(uint16_t n = 0; n < count; n++) {
+        memcpy(&ram_data[(size_t)(addr + n)*SEC_SIZE], buf, SEC_SIZE);
+        io_dev_stats.blocks_written++;
+
+        if(handler == NULL) {
+            buf += SEC_SIZE;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t io_ram_read_block(uint32_t addr, uint8_t * buf) {
+    return io_ram_read_blocks(addr, 1, buf, NULL, NULL);
+}
+
+static uint8_t io_ram_write_block(uint32_t addr, const uint8_t * buf) {
+    return io_ram_write_blocks(addr, 1, buf, NULL, NULL, 0);
+}
+
+static uint32_t io_ram_sector_count(void) {
+    return ram_sectors;
+}
+
+static uint32_t ram_stream_addr; /* next sector of the open read */
+
+static uint8_t io_ram_stream_start(uint32_t addr) {
+    if((ram_data == NULL) || (addr >= ram_sectors)) return 1;
+
+    io_dev_stats.read_cmds++;
+    io_ram_spend(ram_model.command_ns);
+    ram_stream_addr = addr;
+    return 0;
+}
+
+static uint8_t io_ram_stream_read(uint8_t *buf) {
+    if(ram_stream_addr >= ram_sectors) return 1;
+
+    io_ram_spend((uint64_t)ram_model.byte_ns*SEC_SIZE);
+    memcpy(buf, &ram_data[(size_t)ram_stream_addr*SEC_SIZE], SEC_SIZE);
+    io_dev_stats.blocks_read++;
+    ram_stream_addr++;
+    return 0;
+}
+
+static uint8_t io_ram_stream_stop(void) {
+    return 0;
+}
+
+const io_device io_ram_device = {
+    .init = io_ram_init,
+    .read_block = io_ram_read_block,
+    .write_block = io_ram_write_block,
+    .read_blocks = io_ram_read_blocks,
+    .write_blocks = io_ram_write_blocks,
+    .sector_count = io_ram_sector_count,
+    .stream_start = io_ram_stream_start,
+    .stream_read = io_ram_stream_read,
+    .stream_stop = io_ram_stream_stop,
+};
+#endif
@@ -6,9 +6,194 @@
 #else
 #include <avr/io.h>
 #endif
+#include "f32.h"
 
-uint8_t io_init(void);
+/**
+ * Number of sectors held in the block cache. Every entry costs a full
+ * sector of RAM, so the cache is disabled by default on the AVR. Set to 0
+ * to pass every access straight through to the card.
+ */
+#ifndef F32_CACHE_SECTORS
+#ifdef DESKTOP
+#define F32_CACHE_SECTORS   8
+#else
+#define F32_CACHE_SECTORS   0
+#endif
+#endif
+
+/**
+ * Called after each block of a multi-block read, see sd_read_blocks
+ *
+ * @return Buffer for the next block, or NULL to end the transfer early
+ */
+typedef uint8_t * (*io_read_handler)(uint32_t addr, uint8_t *buf, void *ctx);
+
+/**
+ * Called after each block of a multi-block write, see sd_write_blocks
+ *
+ * @return Data for the next block, or NULL to end the transfer early
+ */
+typedef const uint8_t * (*io_write_handler)(uint32_t addr, const uint8_t *buf, void *ctx);
+
+/**
+ * Block device operations. All return 0 on success and 1 on error. The
+ * multi-block transfers follow sd_read_blocks and sd_write_blocks. Every
+ * operation after write_block is optional and may be NULL.
+ */
+typedef struct io_device {
+    uint8_t (*init)(void);
+    uint8_t (*read_block)(uint32_t addr, uint8_t *buf);
+    uint8_t (*write_block)(uint32_t addr, const uint8_t *buf);
+    uint8_t (*read_blocks)(uint32_t addr, uint16_t count, uint8_t *buf, io_read_handler handler, void *ctx);
+    uint8_t (*write_blocks)(uint32_t addr, uint16_t count, const uint8_t *buf, io_write_handler handler, void *ctx, uint8_t pre_erase);
+    uint8_t (*sync)(void); /* make completed writes durable */
+    uint8_t (*poll)(void); /* 1 while the device is still busy with a write */
+    uint8_t (*trim)(uint32_t addr, uint32_t count); /* sectors no longer hold data */
+    uint32_t (*sector_count)(void); /* size of the device, 0 if unknown */
+    uint8_t (*stream_start)(uint32_t addr); /* open-ended read, see sd_stream_start */
+    uint8_t (*stream_read)(uint8_t *buf);
+    uint8_t (*stream_stop)(void);
+} io_device;
+
+#ifdef DESKTOP
+extern const io_device io_image_device; /* test_mmc.img in the working directory */
+#define IO_DEFAULT_DEVICE   io_image_device
+
+/**
+ * Image file mapped into memory, so sector I/O is a memcpy against the
+ * page cache. Sync writes the mapping back with msync. The file is
+ * (re)mapped on every mount and its size is fixed.
+ */
+extern const io_device io_mmap_device;
+
+/**
+ * Image file used by io_mmap_device, test_mmc.img by default. The string
+ * must stay valid while the device is in use.
+ */
+void io_mmap_path(const char * path);
+
+/**
+ * Latency model for io_ram_device, loosely following an SD card on SPI.
+ * Every command costs command_ns plus byte_ns per data byte. Each block
+ * written has a 1 in busy_chance chance of leaving the card busy for
+ * busy_max_us/2 to busy_max_us. The stalls come from a generator seeded
+ * with seed, so runs repeat exactly.
+ */
+typedef struct {
+    uint32_t command_ns;
+    uint32_t byte_ns;
+    uint32_t busy_chance; /* 0 never stalls */
+    uint32_t busy_max_us;
+    uint32_t seed;
+    uint8_t sleep; /* also spend the modelled time in nanosleep */
+} io_ram_model;
+
+/**
+ * Block device held entirely in memory, loaded from an image file with
+ * io_ram_load. Time the model says the card would have spent accumulates
+ * in io_ram_time_ns.
+ */
+extern const io_device io_ram_device;
+extern uint64_t io_ram_time_ns;
+
+uint8_t io_ram_load(const char * path);
+
+/**
+ * Set the latency model (NULL for none) and clear io_ram_time_ns
+ */
+void io_ram_set_model(const io_ram_model * model);
+#else
+extern const io_device io_sd_device;
+#define IO_DEFAULT_DEVICE   io_sd_device
+#endif
+
+uint8_t io_init(const io_device * device);
 uint8_t io_read_block(uint32_t addr, uint8_t * buf);
 uint8_t io_write_block(uint32_t addr, const uint8_t *buf);
 
-#endif
\ No newline at end of file
+/**
+ * Write consecutive sectors straight from buf with one multi-block write.
+ * Cached copies of the sectors are updated to match.
+ */
+uint8_t io_write_blocks(uint32_t addr, uint16_t count, const uint8_t * buf);
+
+/**
+ * Prefetch a run of consecutive sectors into the cache with one multi-block
+ * read. Does nothing if the first sector is already cached, the cache is
+ * too small to hold the run or part of the run is waiting in the
+ * write-behind queue.
+ *
+ * @return 0, failures are left for the following io_read_block to report
+ */
+uint8_t io_read_ahead(uint32_t addr, uint16_t count);
+
+/**
+ * Read the first sector of a run of count consecutive sectors. Without a
+ * read-ahead cache the multi-block read started for the run is left open,
+ * so reading the following sectors of the run in turn costs no further
+ * commands. Any other access to the device ends the read first.
+ */
+uint8_t io_read_stream(uint32_t addr, uint16_t count, uint8_t * buf);
+
+/**
+ * Write every dirty cached sector and every queued sector back to the card
+ * and sync the device
+ */
+uint8_t io_flush(void);
+
+/**
+ * Write queued sectors while the device is idle, see f32_poll
+ */
+uint8_t io_poll(void);
+
+/**
+ * Tell the device a run of sectors no longer holds data. Cached copies
+ * are dropped without being written back.
+ */
+uint8_t io_trim(uint32_t addr, uint32_t count);
+
+/**
+ * Number of sectors on the device, 0 if the device doesn't say
+ */
+uint32_t io_sector_count(void);
+
+/**
+ * Keep a sector resident in the cache until it is unpinned. Pins nest, so
+ * every io_pin_block must be matched by an io_unpin_block.
+ *
+ * @return 0 if the sector is resident, 1 on read error or if no entry is free
+ */
+uint8_t io_pin_block(uint32_t addr);
+void io_unpin_block(uint32_t addr);
+
+/**
+ * Statistics hooks for the file system. io_stats_layout tells the I/O
+ * layer where the FAT and data regions start so sectors can be classed by
+ * address; io_stats_next marks the next single-sector read or write as
+ * belonging to another class, which is how directory sectors are told
+ * apart from file data.
+ */
+#if F32_STATS
+void io_stats_layout(uint32_t fat_start, uint32_t data_start);
+void io_stats_next(uint8_t cls);
+#else
+#define io_stats_layout(fat_start, data_start)
+#define io_stats_next(cls)
+#endif
+
+#ifdef DESKTOP
+/**
+ * Traffic seen by the desktop image backend. Multi-block transfers count
+ * as one command.
+ */
+typedef struct {
+    uint32_t read_cmds;
+    uint32_t write_cmds;
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+} io_desktop_stats;
+
+extern io_desktop_stats io_dev_stats;
+#endif
+
+#endif
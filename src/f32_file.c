@@ -54,11 +54,13 @@ uint8_t f32_create_file(
     en.DIR_WrtTime = en.DIR_CrtTime;
     en.DIR_WrtDate = en.DIR_CrtDate;
 
+    io_stats_next(F32_CLASS_DIR);
     if(io_read_block(dir_sector, buf->data)) {
         return 1;
     }
 
     memcpy(&buf->data[dir_offset], &en, sizeof(en));
+    io_stats_next(F32_CLASS_DIR);
     if(io_write_block(dir_sector, buf->data)) {
         return 1;
     }
@@ -70,11 +72,15 @@ uint8_t f32_create_file(
     fd->sector_count = 0;
     fd->file_entry_sector = dir_sector;
     fd->file_entry_offset = dir_offset;
+    fd->flags = 0;
+    fd->unsynced_bytes = 0;
+    fd->extent_count = 0;
 
     return 0;
 }
 
 uint8_t f32_update_file(const f32_file * fd) {
+    io_stats_next(F32_CLASS_DIR);
     if(io_read_block(fd->file_entry_sector, buf->data)) { return 1; }
     DIR_Entry * en = (DIR_Entry*)&buf->data[fd->file_entry_offset];
     en->DIR_FileSize = fd->size;
@@ -86,6 +92,57 @@ uint8_t f32_update_file(const f32_file * fd) {
     en->DIR_WrtDate |= (uint16_t)(rtc.month & 0x0F) << 5;
     en->DIR_WrtDate |= (uint16_t)((rtc.year - 1980) & 0x7F) << 9;
     #endif
+    io_stats_next(F32_CLASS_DIR);
     if(io_write_block(fd->file_entry_sector, buf->data)) { return 1; }
     return 0;
-}
\ No newline at end of file
+}
+
+/** Byte offsets of the characters in a long name entry */
+static const uint8_t lfn_offsets[LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+static inline char f32_lfn_lower(uint16_t c) {
+    return ((c >= 'A') && (c <= 'Z')) ? c - 'A' + 'a' : c;
+}
+
+uint8_t f32_lfn_checksum(const uint8_t * short_name) {
+    uint8_t sum = 0;
+    for(uint8_t i = 0; i < 11; i++) {
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + short_name[i];
+    }
+
+    return sum;
+}
+
+uint8_t f32_lfn_match(const uint8_t * entry, const char * name, uint8_t len) {
+    uint16_t start = ((entry[0] & LFN_ORD_MASK) - 1)*LFN_CHARS;
+    for(uint8_t i = 0; i < LFN_CHARS; i++) {
+        uint16_t n = start + i;
+        uint16_t c = entry[lfn_offsets[i]] | ((uint16_t)entry[lfn_offsets[i] + 1] << 8);
+
+        if(n == len) {
+            // a shorter name ends here, the padding after it doesn't matter
+            return c == 0;
+        }
+
+        if((n > len) || (c > 0x7F) || (f32_lfn_lower(c) != f32_lfn_lower((uint8_t)name[n]))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void f32_lfn_fill(uint8_t * entry, const char * name, uint8_t len, uint8_t ord, uint8_t checksum) {
+    memset(entry, 0, sizeof(DIR_Entry));
+    entry[0] = ord;
+    entry[11] = ATTR_LONG_NAME;
+    entry[LFN_CHECKSUM] = checksum;
+
+    uint16_t start = ((ord & LFN_ORD_MASK) - 1)*LFN_CHARS;
+    for(uint8_t i = 0; i < LFN_CHARS; i++) {
+        uint16_t n = start + i;
+        uint16_t c = (n < len) ? (uint8_t)name[n] : (n == len) ? 0x0000 : 0xFFFF;
+        entry[lfn_offsets[i]] = c;
+        entry[lfn_offsets[i] + 1] = c >> 8;
+    }
+}
@@ -18,6 +18,17 @@
 #define ATTR_ARCHIVE        0x20
 #define ATTR_LONG_NAME      ((ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID))
 
+/**
+ * Long file name entries. Each holds LFN_CHARS UCS-2 characters of the
+ * name and precedes the short entry it belongs to, last part first. The
+ * first byte is the part's number, with LFN_LAST set on the final part.
+ */
+#define LFN_CHARS           13
+#define LFN_LAST            0x40
+#define LFN_ORD_MASK        0x1F
+#define LFN_MAX             255
+#define LFN_CHECKSUM        13 /* offset of the checksum byte */
+
 /**
  * File/Directory entry
  */
@@ -41,4 +52,22 @@ uint8_t f32_create_file(f32_file * fd, const char fname[], uint32_t dir_sector,
 uint8_t f32_update_file(const f32_file * fd);
 uint32_t f32_allocate_free(void);
 
+/**
+ * Checksum of an 11 character short name, stored in each of its long
+ * name entries
+ */
+uint8_t f32_lfn_checksum(const uint8_t * short_name);
+
+/**
+ * Compare the part of name held by a long name entry, ignoring ASCII case
+ *
+ * @return 1 if the part matches
+ */
+uint8_t f32_lfn_match(const uint8_t * entry, const char * name, uint8_t len);
+
+/**
+ * Fill a long name entry with part ord of name
+ */
+void f32_lfn_fill(uint8_t * entry, const char * name, uint8_t len, uint8_t ord, uint8_t checksum);
+
 #endif
\ No newline at end of file
@@ -73,3 +73,27 @@ void f32_print_timestamp(uint16_t timestamp) {
     uint8_t seconds = (timestamp & 0x1F) * 2;
     printf("%02u:%02u:%02u\n", hours, minutes, seconds);
 }
+
+#if F32_STATS
+void f32_print_stats(const f32_stats * stats) {
+    static const char * const classes[F32_CLASSES] = { "boot", "fat", "dir", "data" };
+
+    printf("class\treads\twrites\tcard rd\tcard wr\n");
+    for(uint8_t i = 0; i < F32_CLASSES; i++) {
+        printf("%s\t%lu\t%lu\t%lu\t%lu\n", classes[i],
+            (unsigned long)stats->reads[i], (unsigned long)stats->writes[i],
+            (unsigned long)stats->card_reads[i], (unsigned long)stats->card_writes[i]);
+    }
+
+    printf("Commands: %lu read, %lu write\n",
+        (unsigned long)stats->read_cmds, (unsigned long)stats->write_cmds);
+    printf("Latency (ticks):\n");
+    for(uint8_t i = 0; i < F32_STATS_BUCKETS; i++) {
+        if(i < F32_STATS_BUCKETS - 1) {
+            printf("\t< %lu\t%lu\n", 4UL << (2*i), (unsigned long)stats->latency[i]);
+        } else {
+            printf("\trest\t%lu\n", (unsigned long)stats->latency[i]);
+        }
+    }
+}
+#endif
@@ -9,5 +9,8 @@ void f32_print_fname(const char * fname);
 void f32_print_dirname(const char * dirname);
 void f32_print_date(uint16_t date);
 void f32_print_timestamp(uint16_t timestamp);
+#if F32_STATS
+void f32_print_stats(const f32_stats * stats);
+#endif
 
 #endif
\ No newline at end of file
@@ -1,6 +1,10 @@
+#ifdef DESKTOP
+#include <stdint.h>
+#else
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/pgmspace.h>
+#endif
 #include "sdcard.h"
 #include "spi.h"
 #include <stdio.h>
@@ -20,13 +24,20 @@
 #define CMD10               9
 #define CMD10_ARG           0x00000000
 #define CMD10_CRC           0x00
+#define CMD12               12
+#define CMD12_ARG           0x00000000
+#define CMD12_CRC           0x00
 #define CMD13               13
 #define CMD13_ARG           0x00000000
 #define CMD13_CRC           0x00
 #define CMD17               17
 #define CMD17_CRC           0x00
+#define CMD18               18
+#define CMD18_CRC           0x00
 #define CMD24               24
 #define CMD24_CRC           0x00
+#define CMD25               25
+#define CMD25_CRC           0x00
 #define CMD55               55
 #define CMD55_ARG           0x00000000
 #define CMD55_CRC           0x00
@@ -36,10 +47,12 @@
 #define ACMD41              41
 #define ACMD41_ARG          0x40000000
 #define ACMD41_CRC          0x00
+#define ACMD23              23
+#define ACMD23_CRC          0x00
 
 #define SD_IN_IDLE_STATE    0x01
 #define SD_READY            0x00
-#define SD_R1_NO_ERROR(X)   X < 0x02
+#define SD_R1_NO_ERROR(X)   ((X) < 0x02)
 
 #define R3_BYTES            4
 #define R7_BYTES            4
@@ -50,8 +63,14 @@
 #define SD_INIT_CYCLES          80
 
 #define SD_START_TOKEN          0xFE
+#define SD_MULTI_START_TOKEN    0xFC
+#define SD_STOP_TRAN_TOKEN      0xFD
 #define SD_ERROR_TOKEN          0x00
 
+#define SD_CSD_LEN              16
+#define SD_INIT_HZ              400000 /* identification mode limit */
+#define SD_DEFAULT_HZ           25000000 /* default speed every card supports */
+
 #define SD_DATA_ACCEPTED        0x05
 #define SD_DATA_REJECTED_CRC    0x0B
 #define SD_DATA_REJECTED_WRITE  0x0D
@@ -68,6 +87,14 @@ static uint8_t sd_go_idle(void);
 static void sd_send_if_cond(uint8_t *res);
 static uint8_t sd_send_app(void);
 static uint8_t sd_send_op_cond(void);
+static uint8_t sd_stop_transmission(void);
+static uint8_t sd_set_wr_blk_erase_count(uint32_t count);
+static uint8_t sd_wait_ready(void);
+static uint8_t sd_read_csd(uint8_t *csd);
+static void sd_configure(void);
+
+static uint32_t sd_sectors;
+static uint8_t sd_busy; /* a write may still be programming */
 
 uint8_t sd_init() {
     uint8_t res[5], cmdAttempts = 0;
@@ -75,6 +102,7 @@ uint8_t sd_init() {
     SD_CS_DDR |= (1 << SD_CS_PIN);
     CS_DISABLE();
     spi_init();
+    spi_set_speed(SD_INIT_HZ);
 
     _delay_ms(10);
 
@@ -103,6 +131,7 @@ uint8_t sd_init() {
         }
 
         if(res[0] == SD_READY) {
+            sd_configure();
             return 0;
         }
 
@@ -144,7 +173,7 @@ uint8_t sd_read_block(uint32_t addr, uint8_t *buf) {
         // if response token is 0xFE
         if(token == SD_START_TOKEN) {
             // read 512 byte block
-            for(uint16_t i = 0; i < SD_BLOCK_LEN; i++) *buf++ = spi_transfer(0xFF);
+            spi_read_block(buf, SD_BLOCK_LEN);
 
             // read 16-bit CRC
             spi_transfer(0xFF);
@@ -164,6 +193,91 @@ uint8_t sd_read_block(uint32_t addr, uint8_t *buf) {
     return 1;
 }
 
+uint8_t sd_stream_start(uint32_t addr) {
+    // assert chip select, it stays asserted until sd_stream_stop
+    spi_transfer(0xFF);
+    CS_ENABLE();
+    spi_transfer(0xFF);
+
+    // send CMD18
+    sd_command(CMD18, addr, CMD18_CRC);
+
+    // read R1
+    if(sd_read_res1() == 0x00) {
+        return 0;
+    }
+
+    // deassert chip select
+    spi_transfer(0xFF);
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    return 1;
+}
+
+uint8_t sd_stream_read(uint8_t *buf) {
+    uint16_t readAttempts = 0;
+
+    // set token to none
+    uint8_t token = 0xFF;
+
+    // wait for a response token (timeout = 100ms)
+    while(++readAttempts != SD_MAX_READ_ATTEMPTS) {
+        if((token = spi_transfer(0xFF)) != 0xFF) break;
+    }
+
+    if(token != SD_START_TOKEN) {
+        return 1;
+    }
+
+    // read 512 byte block
+    spi_read_block(buf, SD_BLOCK_LEN);
+
+    // read 16-bit CRC
+    spi_transfer(0xFF);
+    spi_transfer(0xFF);
+
+    return 0;
+}
+
+uint8_t sd_stream_stop(void) {
+    uint8_t res = sd_stop_transmission();
+
+    // deassert chip select
+    spi_transfer(0xFF);
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    return res;
+}
+
+uint8_t sd_read_blocks(uint32_t addr, uint16_t count, uint8_t *buf, sd_read_handler handler, void *ctx) {
+    uint8_t res = 0;
+
+    if(sd_stream_start(addr)) {
+        return 1;
+    }
+
+    for(uint16_t n = 0; n < count; n++) {
+        if(sd_stream_read(buf)) {
+            res = 1;
+            break;
+        }
+
+        if(handler == NULL) {
+            buf += SD_BLOCK_LEN;
+        } else if((buf = handler(addr + n, buf, ctx)) == NULL) {
+            break;
+        }
+    }
+
+    if(sd_stream_stop()) {
+        res = 1;
+    }
+
+    return res;
+}
+
 #define SD_MAX_WRITE_ATTEMPTS   60000
 // #define SD_MAX_WRITE_ATTEMPTS   3907
 
@@ -191,7 +305,7 @@ uint8_t sd_write_block(uint32_t addr, const uint8_t *buf) {
         spi_transfer(SD_START_TOKEN);
 
         // write buffer to card
-        for(uint16_t i = 0; i < SD_BLOCK_LEN; i++) token = spi_transfer(buf[i]);
+        spi_write_block(buf, SD_BLOCK_LEN);
 
         // wait for a response (timeout = 250ms)
         readAttempts = 0;
@@ -204,6 +318,10 @@ uint8_t sd_write_block(uint32_t addr, const uint8_t *buf) {
 
         // if data accepted
         if((token & 0x1F) == 0x05) {
+#if SD_DEFER_BUSY
+            // the card programs on its own, the next command waits for it
+            sd_busy = 1;
+#else
             // wait for write to finish (timeout = 250ms)
             readAttempts = 0;
             while(spi_transfer(0xFF) == 0x00) {
@@ -213,6 +331,7 @@ uint8_t sd_write_block(uint32_t addr, const uint8_t *buf) {
                     break;
                 }
             }
+#endif
         } else {
             printf("Data not accepted!: 0x%02X\n", token);
         }
@@ -234,7 +353,104 @@ uint8_t sd_write_block(uint32_t addr, const uint8_t *buf) {
     return token;
 }
 
+uint8_t sd_write_blocks(uint32_t addr, uint16_t count, const uint8_t *buf, sd_write_handler handler, void *ctx, uint8_t pre_erase) {
+    uint8_t res1;
+    uint16_t readAttempts, n = 0;
+
+    // set token to none
+    uint8_t token = 0xFF;
+
+    // pre-erase is only a hint, carry on if the card rejects it
+    if(pre_erase) {
+        sd_set_wr_blk_erase_count(count);
+    }
+
+    // assert chip select
+    spi_transfer(0xFF);
+    CS_ENABLE();
+    spi_transfer(0xFF);
+
+    // send CMD25
+    sd_command(CMD25, addr, CMD25_CRC);
+
+    // read response
+    res1 = sd_read_res1();
+
+    // if no error
+    if(res1 == SD_READY) {
+        while(n < count) {
+            // send start token
+            spi_transfer(SD_MULTI_START_TOKEN);
+
+            // write block to card
+            spi_write_block(buf, SD_BLOCK_LEN);
+
+            // send 16-bit CRC
+            spi_transfer(0xFF);
+            spi_transfer(0xFF);
+
+            // wait for a response (timeout = 250ms)
+            readAttempts = 0;
+            while((token = spi_transfer(0xFF)) == 0xFF) {
+                if(readAttempts++ == SD_MAX_WRITE_ATTEMPTS) {
+                    break;
+                }
+            }
+
+            // stop on anything but data accepted
+            if((token & 0x1F) != SD_DATA_ACCEPTED) {
+                printf("Data not accepted!: 0x%02X\n", token);
+                break;
+            }
+
+            // wait for block to be programmed (timeout = 250ms)
+            if(sd_wait_ready()) {
+                token = 0x00;
+                printf("Card timed out!\n");
+                break;
+            }
+
+            n++;
+            if(handler == NULL) {
+                buf += SD_BLOCK_LEN;
+            } else if((buf = handler(addr + n - 1, buf, ctx)) == NULL) {
+                break;
+            }
+        }
+
+        // end the transfer and wait for the card to finish
+        spi_transfer(SD_STOP_TRAN_TOKEN);
+        spi_transfer(0xFF);
+#if SD_DEFER_BUSY
+        sd_busy = 1;
+#else
+        if(sd_wait_ready()) {
+            token = 0x00;
+        }
+#endif
+    } else {
+        printf("Card not ready!: 0x%02X\n", res1);
+    }
+
+    // deassert chip select
+    spi_transfer(0xFF);
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    if((res1 == 0x00) && ((token & 0x1F) == SD_DATA_ACCEPTED)) {
+        return 0;
+    }
+
+    return 1;
+}
+
 void sd_command(uint8_t cmd, uint32_t arg, uint8_t crc) {
+    // a deferred write has to finish first, a timeout shows up in the response
+    if(sd_busy) {
+        sd_wait_ready();
+        sd_busy = 0;
+    }
+
     // transmit command to sd card
     spi_transfer(cmd | 0x40);
 
@@ -248,6 +464,170 @@ void sd_command(uint8_t cmd, uint32_t arg, uint8_t crc) {
     spi_transfer(crc|0x01);
 }
 
+uint8_t sd_stop_transmission() {
+    // send CMD12, the byte following it is a stuff byte
+    sd_command(CMD12, CMD12_ARG, CMD12_CRC);
+    spi_transfer(0xFF);
+
+    if(sd_read_res1() & 0x80) {
+        return 1;
+    }
+
+    // wait for the card to release busy
+    return sd_wait_ready();
+}
+
+uint8_t sd_wait_ready() {
+    uint16_t readAttempts = 0;
+
+    while(spi_transfer(0xFF) == 0x00) {
+        if(readAttempts++ == SD_MAX_WRITE_ATTEMPTS) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t sd_poll() {
+    if(!sd_busy) {
+        return 0;
+    }
+
+    // the card holds its output low while it is busy
+    spi_transfer(0xFF);
+    CS_ENABLE();
+    if(spi_transfer(0xFF) != 0x00) {
+        sd_busy = 0;
+    }
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    return sd_busy;
+}
+
+uint8_t sd_sync() {
+    if(!sd_busy) {
+        return 0;
+    }
+
+    spi_transfer(0xFF);
+    CS_ENABLE();
+    uint8_t res = sd_wait_ready();
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    sd_busy = 0;
+    return res;
+}
+
+uint8_t sd_set_wr_blk_erase_count(uint32_t count) {
+    uint8_t res1 = sd_send_app();
+    if(!SD_R1_NO_ERROR(res1)) {
+        return res1;
+    }
+
+    // assert chip select
+    spi_transfer(0xFF);
+    CS_ENABLE();
+    spi_transfer(0xFF);
+
+    // send ACMD23
+    sd_command(ACMD23, count & 0x7FFFFF, ACMD23_CRC);
+
+    // read response
+    res1 = sd_read_res1();
+
+    // deassert chip select
+    spi_transfer(0xFF);
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    return res1;
+}
+
+uint32_t sd_sector_count() {
+    return sd_sectors;
+}
+
+void sd_configure() {
+    uint8_t csd[SD_CSD_LEN];
+    uint32_t max_hz = SD_DEFAULT_HZ;
+    sd_sectors = 0;
+
+    if(sd_read_csd(csd) == 0) {
+        // TRAN_SPEED: time value (tenths) times a power of ten unit from 100 kbit/s
+        static const uint8_t tran_value[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+        uint32_t unit = 10000;
+        for(uint8_t i = 0; i < (csd[3] & 0x07); i++) {
+            unit *= 10;
+        }
+        if(tran_value[(csd[3] >> 3) & 0x0F]) {
+            max_hz = unit*tran_value[(csd[3] >> 3) & 0x0F];
+        }
+
+        if((csd[0] >> 6) == 1) {
+            // CSD version 2.0: (C_SIZE + 1) * 512 KiB
+            uint32_t c_size = ((uint32_t)(csd[7] & 0x3F) << 16) | ((uint32_t)csd[8] << 8) | csd[9];
+            sd_sectors = (c_size + 1) << 10;
+        } else {
+            // CSD version 1.0: (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) blocks of 2^READ_BL_LEN bytes
+            uint16_t c_size = ((uint16_t)(csd[6] & 0x03) << 10) | ((uint16_t)csd[7] << 2) | (csd[8] >> 6);
+            uint8_t mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+            uint8_t bl_len = csd[5] & 0x0F;
+            sd_sectors = (uint32_t)(c_size + 1) << (mult + 2 + bl_len - 9);
+        }
+    }
+
+    spi_set_speed(max_hz);
+}
+
+uint8_t sd_read_csd(uint8_t *csd) {
+    uint8_t res1;
+    uint16_t readAttempts;
+
+    // set token to none
+    uint8_t token = 0xFF;
+
+    // assert chip select
+    spi_transfer(0xFF);
+    CS_ENABLE();
+    spi_transfer(0xFF);
+
+    // send CMD9
+    sd_command(CMD9, CMD9_ARG, CMD9_CRC);
+
+    // read R1
+    res1 = sd_read_res1();
+
+    // the CSD comes as a 16 byte data block
+    if(res1 == 0x00) {
+        readAttempts = 0;
+        while(++readAttempts != SD_MAX_READ_ATTEMPTS) {
+            if((token = spi_transfer(0xFF)) != 0xFF) break;
+        }
+
+        if(token == SD_START_TOKEN) {
+            sd_read_bytes(csd, SD_CSD_LEN);
+
+            // read 16-bit CRC
+            spi_transfer(0xFF);
+            spi_transfer(0xFF);
+        }
+    }
+
+    // deassert chip select
+    spi_transfer(0xFF);
+    CS_DISABLE();
+    spi_transfer(0xFF);
+
+    if((res1 == 0) && (token == SD_START_TOKEN)) {
+        return 0;
+    }
+
+    return 1;
+}
+
 uint8_t sd_read_res1() {
     uint8_t i = 0, res1;
 
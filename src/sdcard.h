@@ -6,10 +6,27 @@
 #define SD_CS_PIN   PINB2
 
 /**
- * Initialize sd card
+ * Return from writes as soon as the card has accepted the data, and wait
+ * for it to finish programming only before the next command, in sd_poll
+ * or in sd_sync. Set to 0 to wait inside every write.
+ */
+#ifndef SD_DEFER_BUSY
+#define SD_DEFER_BUSY   1
+#endif
+
+/**
+ * Initialize sd card. The bus runs at 400 kHz or less until the card is
+ * ready, then at the fastest clock its CSD allows.
  */
 uint8_t sd_init(void);
 
+/**
+ * Card capacity in 512 byte blocks, read from the CSD by sd_init
+ *
+ * @return Number of blocks, 0 if unknown
+ */
+uint32_t sd_sector_count(void);
+
 /**
  * Read single 512 byte block
  * 
@@ -20,6 +37,43 @@ uint8_t sd_init(void);
  */
 uint8_t sd_read_block(uint32_t addr, uint8_t *buf);
 
+/**
+ * Called by sd_read_blocks after each block has been stored
+ *
+ * @param addr  Block address that was just read
+ * @param buf   Buffer holding the block
+ * @param ctx   User pointer passed to sd_read_blocks
+ *
+ * @return Buffer for the next block, or NULL to end the transfer early
+ */
+typedef uint8_t * (*sd_read_handler)(uint32_t addr, uint8_t *buf, void *ctx);
+
+/**
+ * Read consecutive 512 byte blocks with a single READ_MULTIPLE_BLOCK command
+ *
+ * @param addr      First block address to read
+ * @param count     Number of blocks to read
+ * @param buf       Buffer for the first block
+ * @param handler   Called after every block. If NULL, buf must hold
+ *                  count blocks and is filled contiguously.
+ * @param ctx       User pointer passed to handler
+ *
+ * @return 0 on success, 1 on error
+ */
+uint8_t sd_read_blocks(uint32_t addr, uint16_t count, uint8_t *buf, sd_read_handler handler, void *ctx);
+
+/**
+ * Open-ended READ_MULTIPLE_BLOCK. sd_stream_start sends CMD18 and leaves
+ * the card selected, each sd_stream_read then takes the next block off the
+ * card and sd_stream_stop ends the transfer with STOP_TRANSMISSION. No
+ * other command may be sent while the stream is open.
+ *
+ * @return 0 on success, 1 on error
+ */
+uint8_t sd_stream_start(uint32_t addr);
+uint8_t sd_stream_read(uint8_t *buf);
+uint8_t sd_stream_stop(void);
+
 /**
  * Write single 512 byte block
  * 
@@ -34,4 +88,47 @@ uint8_t sd_read_block(uint32_t addr, uint8_t *buf);
  */
 uint8_t sd_write_block(uint32_t addr, const uint8_t *buf);
 
+/**
+ * Called by sd_write_blocks after each block has been accepted
+ *
+ * @param addr  Block address that was just written
+ * @param buf   Buffer the block was sent from
+ * @param ctx   User pointer passed to sd_write_blocks
+ *
+ * @return Data for the next block, or NULL to end the transfer early
+ */
+typedef const uint8_t * (*sd_write_handler)(uint32_t addr, const uint8_t *buf, void *ctx);
+
+/**
+ * Write consecutive 512 byte blocks with a single WRITE_MULTIPLE_BLOCK
+ * command, ended by the stop transmission token
+ *
+ * @param addr      First block address to write
+ * @param count     Number of blocks to write
+ * @param buf       Data for the first block
+ * @param handler   Called after every block. If NULL, buf must hold
+ *                  count blocks and is sent contiguously.
+ * @param ctx       User pointer passed to handler
+ * @param pre_erase If non-zero, announce count with ACMD23 so the card can
+ *                  erase the blocks ahead of the transfer
+ *
+ * @return 0 on success, 1 on error
+ */
+uint8_t sd_write_blocks(uint32_t addr, uint16_t count, const uint8_t *buf, sd_write_handler handler, void *ctx, uint8_t pre_erase);
+
+/**
+ * Check once, without waiting, whether the card has finished the last
+ * write. Cheap enough to call from the application's idle loop.
+ *
+ * @return 0 if the card is ready, 1 if it is still programming
+ */
+uint8_t sd_poll(void);
+
+/**
+ * Wait until the card has finished programming the last write
+ *
+ * @return 0 on success, 1 if the card stayed busy past the timeout
+ */
+uint8_t sd_sync(void);
+
 #endif
@@ -8,11 +8,30 @@ void spi_init() {
     // enable pull up resistor in MISO
     DDR_SPI |= (1 << MISO);
 
-    // set SPI params
-    SPCR = (1 << SPE) | (1 << MSTR);
+    // set SPI params, slowest clock until told otherwise
+    SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
     SPSR = 0;
 }
 
+uint32_t spi_set_speed(uint32_t max_hz) {
+    // the clock is fosc/2^shift for shifts 1 (with SPI2X) to 7
+    uint8_t shift = 1;
+    while((shift < 7) && ((F_CPU >> shift) > max_hz)) {
+        shift++;
+    }
+
+    // odd shifts use SPI2X to halve the next divider up, except fosc/128
+    uint8_t spr = (shift == 7) ? 3 : (shift - 1) >> 1;
+    SPCR = (SPCR & ~((1 << SPR1) | (1 << SPR0))) | ((spr >> 1) << SPR1) | ((spr & 1) << SPR0);
+    if((shift & 1) && (shift != 7)) {
+        SPSR |= (1 << SPI2X);
+    } else {
+        SPSR &= ~(1 << SPI2X);
+    }
+
+    return F_CPU >> shift;
+}
+
 uint8_t spi_transfer(uint8_t data) {
     // load data into register
     SPDR = data;
@@ -23,3 +42,32 @@ uint8_t spi_transfer(uint8_t data) {
     // return SPDR
     return SPDR;
 }
+
+void spi_read_block(uint8_t *buf, uint16_t len) {
+    SPDR = 0xFF;
+    while(--len) {
+        while(!(SPSR & (1 << SPIF)));
+        uint8_t data = SPDR;
+
+        // start the next byte, then store this one while it shifts
+        SPDR = 0xFF;
+        *buf++ = data;
+    }
+
+    // reading SPDR after SPIF leaves the flag clear for spi_transfer
+    while(!(SPSR & (1 << SPIF)));
+    *buf = SPDR;
+}
+
+void spi_write_block(const uint8_t *buf, uint16_t len) {
+    SPDR = *buf++;
+    while(--len) {
+        // fetch the next byte while the current one shifts
+        uint8_t data = *buf++;
+        while(!(SPSR & (1 << SPIF)));
+        SPDR = data;
+    }
+
+    while(!(SPSR & (1 << SPIF)));
+    (void)SPDR;
+}
@@ -1,10 +1,27 @@
 #ifndef __SPI_H__
 #define __SPI_H__
 
+#ifdef DESKTOP
+#include <stdint.h>
+
+/**
+ * Host build: spi_transfer is provided by a card emulator, which watches
+ * chip select through these stand-ins for the port registers
+ */
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PORTB;
+#define PINB2               2
+#define PINB3               3
+#define PINB4               4
+#define PINB5               5
+
+void _delay_ms(double ms);
+#else
 #include <avr/io.h>
+#endif
 
 // pin definitions
-#if defined(__AVR_ATmega328P__)
+#if defined(__AVR_ATmega328P__) || defined(DESKTOP)
 #define DDR_SPI             DDRB
 #define PORT_SPI            PORTB
 #define CS                  PINB2
@@ -26,4 +43,19 @@
 void spi_init(void);
 uint8_t spi_transfer(uint8_t data);
 
+/**
+ * Clock in len bytes (len > 0) while sending 0xFF, or clock out len bytes.
+ * The next transfer is started before the previous byte is stored or
+ * after the next byte is loaded, so the bus never waits on the CPU.
+ */
+void spi_read_block(uint8_t *buf, uint16_t len);
+void spi_write_block(const uint8_t *buf, uint16_t len);
+
+/**
+ * Pick the fastest SPI clock that does not exceed max_hz
+ *
+ * @return Clock actually selected in Hz
+ */
+uint32_t spi_set_speed(uint32_t max_hz);
+
 #endif
@@ -0,0 +1,277 @@
+#include "f32.h"
+#include "f32_access.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Throughput benchmarks run against the desktop image backend. Every
+ * benchmark prints one JSON object per line so runs can be compared with
+ * a script. The image is modified, so run this on a scratch copy.
+ *
+ * gcc -DDESKTOP -DF32_NO_RTC=1 -Isrc -o bench tests/bench.c src/f32*.c
+ * ./bench > bench_output.txt
+ *
+ * "./bench mmap [image]" runs the same workloads on the mmap backend.
+ * "./bench ram" runs them on a RAM disk with an SD card latency model and
+ * also reports the time the card would have taken.
+ */
+
+#define BIG_FILE_SECTORS    4096 /* 2 MiB */
+#define RANDOM_READS        2000
+#define LOG_LINES           5000
+#define LOG_LINE_SIZE       40
+#define CREATE_FILES        200
+#define ALLOC_CLUSTERS      32
+#define FILL_FILE_BYTES     (1UL << 31) /* FAT32 files stay below 4 GiB */
+
+typedef struct {
+    const char * name;
+    struct timespec start;
+    io_desktop_stats io;
+    uint64_t card_ns;
+} bench;
+
+static f32_sector sec;
+static const io_device * dev = &IO_DEFAULT_DEVICE;
+
+static void bench_start(bench * b, const char * name) {
+    b->name = name;
+    if(f32_mount_dev(dev, &sec)) {
+        fprintf(stderr, "%s: mount failed\n", name);
+        exit(1);
+    }
+
+    b->io = io_dev_stats;
+    b->card_ns = io_ram_time_ns;
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void bench_end(bench * b, uint32_t ops, uint32_t bytes) {
+    if(f32_umount()) {
+        fprintf(stderr, "%s: umount failed\n", b->name);
+        exit(1);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - b->start.tv_sec) + (end.tv_nsec - b->start.tv_nsec)*1e-9;
+
+    uint32_t read_cmds = io_dev_stats.read_cmds - b->io.read_cmds;
+    uint32_t write_cmds = io_dev_stats.write_cmds - b->io.write_cmds;
+    uint32_t blocks_read = io_dev_stats.blocks_read - b->io.blocks_read;
+    uint32_t blocks_written = io_dev_stats.blocks_written - b->io.blocks_written;
+
+    printf("{\"bench\": \"%s\", \"ops\": %u, \"bytes\": %u, \"seconds\": %.6f, \"card_seconds\": %.6f, "
+           "\"mb_per_s\": %.3f, \"ops_per_s\": %.1f, "
+           "\"read_cmds\": %u, \"write_cmds\": %u, \"blocks_read\": %u, \"blocks_written\": %u, "
+           "\"sector_io_per_op\": %.3f}\n",
+        b->name, ops, bytes, secs, (io_ram_time_ns - b->card_ns)*1e-9,
+        secs > 0 ? bytes/secs/1e6 : 0.0, secs > 0 ? ops/secs : 0.0,
+        read_cmds, write_cmds, blocks_read, blocks_written,
+        ops ? (double)(blocks_read + blocks_written)/ops : 0.0);
+    fflush(stdout);
+}
+
+static f32_file * bench_open(const char * fname, const char * modes) {
+    f32_file * fd = f32_open(fname, modes);
+    if(fd == NULL) {
+        fprintf(stderr, "cannot open %s\n", fname);
+        exit(1);
+    }
+
+    return fd;
+}
+
+/** Read HAMLET.TXT from start to end a few times */
+static void bench_seq_read_small(void) {
+    bench b;
+    uint32_t ops = 0, bytes = 0;
+    uint16_t br;
+
+    bench_start(&b, "seq_read_hamlet");
+    for(int i = 0; i < 20; i++) {
+        f32_file * fd = bench_open("HAMLET.TXT", "r");
+        while((br = f32_read(fd)) != F32_EOF) {
+            bytes += br;
+            ops++;
+        }
+        f32_close(fd);
+    }
+    bench_end(&b, ops, bytes);
+}
+
+/** Write a large file one sector at a time with f32_write_sec */
+static void bench_bulk_write_sec(void) {
+    bench b;
+
+    bench_start(&b, "bulk_write_sec");
+    f32_file * fd = bench_open("BENCH.BIN", "w");
+    for(uint32_t i = 0; i < BIG_FILE_SECTORS; i++) {
+        memset(sec.data, (uint8_t)i, SEC_SIZE);
+        if(f32_write_sec(fd)) {
+            fprintf(stderr, "bulk_write_sec: write failed\n");
+            exit(1);
+        }
+    }
+    f32_close(fd);
+    bench_end(&b, BIG_FILE_SECTORS, BIG_FILE_SECTORS*SEC_SIZE);
+}
+
+/** Read the large file sequentially */
+static void bench_seq_read_big(void) {
+    bench b;
+    uint32_t ops = 0, bytes = 0;
+    uint16_t br;
+
+    bench_start(&b, "seq_read_big");
+    f32_file * fd = bench_open("BENCH.BIN", "r");
+    while((br = f32_read(fd)) != F32_EOF) {
+        bytes += br;
+        ops++;
+    }
+    f32_close(fd);
+    bench_end(&b, ops, bytes);
+}
+
+/** Seek to random sectors of the large file and read them */
+static void bench_random_read(void) {
+    bench b;
+    uint32_t bytes = 0;
+    uint32_t seed = 12345;
+
+    bench_start(&b, "random_seek_read");
+    f32_file * fd = bench_open("BENCH.BIN", "r");
+    for(int i = 0; i < RANDOM_READS; i++) {
+        seed = seed*1103515245 + 12345;
+        uint32_t sector = (seed >> 8) % BIG_FILE_SECTORS;
+        if(f32_seek(fd, sector*SEC_SIZE)) {
+            fprintf(stderr, "random_seek_read: seek failed\n");
+            exit(1);
+        }
+        bytes += f32_read(fd);
+    }
+    f32_close(fd);
+    bench_end(&b, RANDOM_READS, bytes);
+}
+
+/** Append short lines the way main.c logs */
+static void bench_small_appends(void) {
+    bench b;
+    char line[LOG_LINE_SIZE + 1];
+
+    bench_start(&b, "small_appends");
+    f32_file * fd = bench_open("APPEND.TXT", "a");
+    for(int i = 0; i < LOG_LINES; i++) {
+        snprintf(line, sizeof(line), "[2020/02/25 12:00:00] Hello %-11d\n", i);
+        if(f32_write(fd, (uint8_t*)line, LOG_LINE_SIZE)) {
+            fprintf(stderr, "small_appends: write failed\n");
+            exit(1);
+        }
+    }
+    f32_close(fd);
+    bench_end(&b, LOG_LINES, LOG_LINES*LOG_LINE_SIZE);
+}
+
+/** Create many files in the same directory */
+static void bench_create_files(void) {
+    bench b;
+    char fname[13];
+
+    bench_start(&b, "create_files");
+    for(int i = 0; i < CREATE_FILES; i++) {
+        snprintf(fname, sizeof(fname), "F%07d.TXT", i);
+        f32_close(bench_open(fname, "w"));
+    }
+    bench_end(&b, CREATE_FILES, 0);
+}
+
+/** Fill the volume, then grow a file cluster by cluster */
+static void bench_alloc_full(void) {
+    bench b;
+    uint32_t cluster_bytes = 0;
+
+    // reserve halving chunks until only a little space is left, moving on
+    // to another fill file whenever one reaches FILL_FILE_BYTES
+    if(f32_mount_dev(dev, &sec)) {
+        exit(1);
+    }
+    f32_file * fd = bench_open("ALLOC.BIN", "w");
+    f32_file * fill = NULL;
+    char fname[13];
+    uint8_t fills = 0;
+    uint32_t reserved = 0;
+    for(uint32_t chunk = 1UL << 30; chunk >= 1UL << 19; chunk >>= 1) {
+        while(1) {
+            if((fill == NULL) || (reserved > FILL_FILE_BYTES - chunk)) {
+                if(fill != NULL) {
+                    f32_close(fill);
+                }
+                snprintf(fname, sizeof(fname), "FILL%u.BIN", fills++);
+                fill = bench_open(fname, "w");
+                reserved = 0;
+            }
+
+            if(f32_prealloc(fill, reserved + chunk)) {
+                break;
+            }
+            reserved += chunk;
+        }
+    }
+    f32_close(fill);
+    f32_close(fd);
+    f32_umount();
+
+    static uint8_t data[SEC_SIZE];
+    bench_start(&b, "alloc_nearly_full");
+    fd = bench_open("ALLOC.BIN", "a");
+    uint32_t ops = 0;
+    uint32_t start = fd->current_cluster;
+    while(ops < ALLOC_CLUSTERS) {
+        if(f32_write(fd, data, SEC_SIZE)) {
+            break;
+        }
+        cluster_bytes += SEC_SIZE;
+        if(fd->current_cluster != start) {
+            start = fd->current_cluster;
+            ops++;
+        }
+    }
+    f32_close(fd);
+    bench_end(&b, ops, cluster_bytes);
+}
+
+int main(int argc, char * argv[]) {
+    if((argc > 1) && (strcmp(argv[1], "mmap") == 0)) {
+        dev = &io_mmap_device;
+        if(argc > 2) {
+            io_mmap_path(argv[2]);
+        }
+    } else if((argc > 1) && (strcmp(argv[1], "ram") == 0)) {
+        // 4 MHz SPI, 1 in 200 blocks stalls for up to 250 ms
+        const io_ram_model card = {
+            .command_ns = 20000,
+            .byte_ns = 2000,
+            .busy_chance = 200,
+            .busy_max_us = 250000,
+            .seed = 1,
+        };
+
+        if(io_ram_load("test_mmc.img")) {
+            fprintf(stderr, "cannot load test_mmc.img\n");
+            return 1;
+        }
+        io_ram_set_model(&card);
+        dev = &io_ram_device;
+    }
+
+    bench_seq_read_small();
+    bench_bulk_write_sec();
+    bench_seq_read_big();
+    bench_random_read();
+    bench_small_appends();
+    bench_create_files();
+    bench_alloc_full();
+    return 0;
+}
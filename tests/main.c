@@ -1,5 +1,6 @@
 #include "munit/munit.h"
 #include "f32.h"
+#include "f32_access.h"
 #include <stdio.h>
 
 static MunitResult
@@ -362,6 +363,957 @@ test_write_hamlet_root(const MunitParameter params[], void* data) {
     return MUNIT_OK;
 }
 
+static MunitResult
+test_write_remount(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    f32_file * fd = f32_open("REMOUNT.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    uint8_t buf[SEC_SIZE];
+    for(int i = 0; i < 40; i++) {
+        munit_assert(fread(buf, SEC_SIZE, 1, act) == 1);
+        memcpy(sec.data, buf, SEC_SIZE);
+        munit_assert(f32_write_sec(fd) == 0);
+    }
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+
+    // data must have reached the card, not just the cache
+    munit_assert(f32_mount(&sec) == 0);
+    fd = f32_open("REMOUNT.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 40*SEC_SIZE);
+
+    fseek(act, 0, SEEK_SET);
+    while(f32_read(fd) == SEC_SIZE) {
+        munit_assert(fread(buf, SEC_SIZE, 1, act) == 1);
+        munit_assert_memory_equal(SEC_SIZE, buf, sec.data);
+    }
+
+    fclose(act);
+
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_write_bulk(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    f32_file * fd = f32_open("BULK.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    // odd chunk size so writes straddle sector and cluster boundaries
+    static uint8_t chunk[7*SEC_SIZE + 100];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), act)) > 0) {
+        munit_assert(f32_write(fd, chunk, n) == 0);
+    }
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+
+    munit_assert(f32_mount(&sec) == 0);
+    fd = f32_open("BULK.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 185977);
+
+    uint8_t buf[SEC_SIZE];
+    uint32_t br;
+    fseek(act, 0, SEEK_SET);
+    while((br = f32_read(fd)) != F32_EOF) {
+        munit_assert(fread(buf, br, 1, act) == 1);
+        munit_assert_memory_equal(br, buf, sec.data);
+    }
+
+    fclose(act);
+
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_write_small_appends(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    f32_file * fd = f32_open("LOG.TXT", "a");
+    munit_assert_ptr_not_null(fd);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    // log lines the size main.c writes, crossing several clusters
+    uint8_t line[40];
+    for(int i = 0; i < 600; i++) {
+        munit_assert(fread(line, sizeof(line), 1, act) == 1);
+        munit_assert(f32_write(fd, line, sizeof(line)) == 0);
+    }
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+
+    munit_assert(f32_mount(&sec) == 0);
+    fd = f32_open("LOG.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 600*sizeof(line));
+
+    uint8_t buf[SEC_SIZE];
+    uint32_t br;
+    fseek(act, 0, SEEK_SET);
+    while((br = f32_read(fd)) != F32_EOF) {
+        munit_assert(fread(buf, br, 1, act) == 1);
+        munit_assert_memory_equal(br, buf, sec.data);
+    }
+
+    fclose(act);
+
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_deferred_sync(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    f32_file * fd = f32_open("SYNC.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+
+    uint8_t line[40];
+    memset(line, 'a', sizeof(line));
+    munit_assert(f32_write(fd, line, sizeof(line)) == 0);
+    munit_assert(f32_write(fd, line, sizeof(line)) == 0);
+
+    // directory entry is only updated on sync
+    f32_file * other = f32_open("SYNC.TXT", "r");
+    munit_assert_ptr_not_null(other);
+    munit_assert(other->size == 0);
+    munit_assert(f32_close(other) == 0);
+
+    munit_assert(f32_sync(fd) == 0);
+
+    other = f32_open("SYNC.TXT", "r");
+    munit_assert_ptr_not_null(other);
+    munit_assert(other->size == 2*sizeof(line));
+    munit_assert(f32_close(other) == 0);
+
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_seek_fragmented(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    // interleave two files so their cluster chains are fragmented
+    f32_file * fa = f32_open("FRAGA.TXT", "w");
+    f32_file * fb = f32_open("FRAGB.TXT", "w");
+    munit_assert_ptr_not_null(fa);
+    munit_assert_ptr_not_null(fb);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    static uint8_t chunk[4096];
+    for(int i = 0; i < 40; i++) {
+        munit_assert(fread(chunk, sizeof(chunk), 1, act) == 1);
+        munit_assert(f32_write(fa, chunk, sizeof(chunk)) == 0);
+        munit_assert(f32_write(fb, chunk, sizeof(chunk)) == 0);
+    }
+
+    munit_assert(f32_close(fb) == 0);
+
+    // jump back and forth, past the end of the extent map and back again
+    const uint32_t offsets[] = { 150000, 1000, 80000, 163839, 8192, 120000, 0, 163000 };
+    uint8_t buf[SEC_SIZE];
+    for(int i = 0; i < (int)(sizeof(offsets)/sizeof(offsets[0])); i++) {
+        uint32_t sector_start = offsets[i] & ~(uint32_t)(SEC_SIZE - 1);
+        munit_assert(f32_seek(fa, sector_start) == 0);
+        fseek(act, sector_start, SEEK_SET);
+        munit_assert(fread(buf, SEC_SIZE, 1, act) == 1);
+        munit_assert(f32_read(fa) == SEC_SIZE);
+        munit_assert_memory_equal(SEC_SIZE, buf, sec.data);
+    }
+
+    fclose(act);
+
+    munit_assert(f32_close(fa) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_prealloc(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    f32_file * fa = f32_open("PREA.TXT", "w");
+    munit_assert_ptr_not_null(fa);
+
+    munit_assert(f32_prealloc(fa, 65536) == 0);
+    munit_assert(fa->size == 0);
+
+    f32_file * fb = f32_open("PREB.TXT", "w");
+    munit_assert_ptr_not_null(fb);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    // allocations for the other file must not break up the reserved run
+    static uint8_t chunk[4096];
+    for(int i = 0; i < 16; i++) {
+        munit_assert(fread(chunk, sizeof(chunk), 1, act) == 1);
+        munit_assert(f32_write(fa, chunk, sizeof(chunk)) == 0);
+        munit_assert(f32_write(fb, chunk, sizeof(chunk)) == 0);
+    }
+
+    munit_assert(fa->size == 65536);
+    munit_assert(f32_seek(fa, 65536 - SEC_SIZE) == 0);
+    // test image uses 8 KiB clusters
+    munit_assert(fa->extents[0].length * 8192 == 65536);
+
+    munit_assert(f32_read(fa) == SEC_SIZE);
+    munit_assert_memory_equal(SEC_SIZE, &chunk[sizeof(chunk) - SEC_SIZE], sec.data);
+
+    fclose(act);
+
+    munit_assert(f32_close(fa) == 0);
+    munit_assert(f32_close(fb) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+/**
+ * Image device without multi-block transfers, counting single block calls
+ */
+static uint32_t basic_reads;
+static uint32_t basic_writes;
+
+static uint8_t basic_read_block(uint32_t addr, uint8_t * buf) {
+    basic_reads++;
+    return io_image_device.read_block(addr, buf);
+}
+
+static uint8_t basic_write_block(uint32_t addr, const uint8_t * buf) {
+    basic_writes++;
+    return io_image_device.write_block(addr, buf);
+}
+
+static const io_device basic_device = {
+    .init = NULL,
+    .read_block = basic_read_block,
+    .write_block = basic_write_block,
+};
+
+static uint8_t basic_init(void) {
+    basic_reads = 0;
+    basic_writes = 0;
+    return io_image_device.init();
+}
+
+static MunitResult
+test_custom_device(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    io_device dev = basic_device;
+    dev.init = basic_init;
+
+    f32_sector sec;
+    munit_assert(f32_mount_dev(&dev, &sec) == 0);
+    munit_assert(basic_reads > 0);
+
+    f32_file * fd = f32_open("DEV.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    // whole-sector runs have to fall back to single block writes
+    static uint8_t chunk[4*SEC_SIZE];
+    for(int i = 0; i < 8; i++) {
+        munit_assert(fread(chunk, sizeof(chunk), 1, act) == 1);
+        munit_assert(f32_write(fd, chunk, sizeof(chunk)) == 0);
+    }
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+    munit_assert(basic_writes >= 32);
+
+    munit_assert(f32_mount_dev(&dev, &sec) == 0);
+    fd = f32_open("DEV.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 8*sizeof(chunk));
+
+    uint8_t buf[SEC_SIZE];
+    uint32_t br;
+    fseek(act, 0, SEEK_SET);
+    while((br = f32_read(fd)) != F32_EOF) {
+        munit_assert(fread(buf, br, 1, act) == 1);
+        munit_assert_memory_equal(br, buf, sec.data);
+    }
+
+    fclose(act);
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_mmap_device(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    io_mmap_path("test_mmc.img");
+    munit_assert(f32_mount_dev(&io_mmap_device, &sec) == 0);
+
+    f32_file * fd = f32_open("MAP.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    munit_assert_ptr_not_null(act);
+
+    static uint8_t chunk[3000];
+    for(int i = 0; i < 20; i++) {
+        munit_assert(fread(chunk, sizeof(chunk), 1, act) == 1);
+        munit_assert(f32_write(fd, chunk, sizeof(chunk)) == 0);
+    }
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+
+    // the stdio backend has to see what went through the mapping
+    munit_assert(f32_mount(&sec) == 0);
+    fd = f32_open("MAP.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 20*sizeof(chunk));
+
+    uint8_t buf[SEC_SIZE];
+    uint32_t br;
+    fseek(act, 0, SEEK_SET);
+    while((br = f32_read(fd)) != F32_EOF) {
+        munit_assert(fread(buf, br, 1, act) == 1);
+        munit_assert_memory_equal(br, buf, sec.data);
+    }
+
+    fclose(act);
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static uint64_t ram_disk_run(const io_ram_model * model) {
+    f32_sector sec;
+    munit_assert(io_ram_load("test_mmc.img") == 0);
+    io_ram_set_model(model);
+    munit_assert(f32_mount_dev(&io_ram_device, &sec) == 0);
+
+    f32_file * fd = f32_open("RAM.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    for(int i = 0; i < 200; i++) {
+        munit_assert(f32_write(fd, (const uint8_t*)"0123456789abcdefghijklmnopqrstuvwxyz\n", 37) == 0);
+    }
+    munit_assert(f32_close(fd) == 0);
+
+    fd = f32_open("RAM.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 200*37);
+    munit_assert(f32_read(fd) == SEC_SIZE);
+    munit_assert_memory_equal(10, "0123456789", sec.data);
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return io_ram_time_ns;
+}
+
+static MunitResult
+test_ram_device(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    io_ram_model model = {
+        .command_ns = 50000,
+        .byte_ns = 2000,
+        .busy_chance = 4,
+        .busy_max_us = 250000,
+        .seed = 1,
+    };
+
+    uint64_t t = ram_disk_run(&model);
+    munit_assert(t > 0);
+    munit_assert(ram_disk_run(&model) == t);
+
+    // stalls only add time
+    model.busy_chance = 0;
+    munit_assert(ram_disk_run(&model) < t);
+
+    munit_assert(ram_disk_run(NULL) == 0);
+
+    // nothing reached the image file
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+    munit_assert_null(f32_open("RAM.TXT", "r"));
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+#if F32_STATS
+static MunitResult
+test_stats(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    f32_stats st;
+    munit_assert(f32_mount(&sec) == 0);
+    munit_assert(f32_get_stats(&st, 1) == 0);
+    munit_assert(st.reads[F32_CLASS_BOOT] > 0);
+
+    f32_file * fd = f32_open("TEST.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_read(fd) == 20);
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_get_stats(&st, 0) == 0);
+    munit_assert(st.reads[F32_CLASS_DIR] == 1);
+    munit_assert(st.reads[F32_CLASS_DATA] == 1);
+    munit_assert(st.writes[F32_CLASS_DATA] == 0);
+
+    fd = f32_open("STATS.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_write(fd, (const uint8_t*)"stats\n", 6) == 0);
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_get_stats(&st, 0) == 0);
+    munit_assert(st.writes[F32_CLASS_DIR] >= 2);
+    munit_assert(st.writes[F32_CLASS_DATA] == 1);
+    munit_assert(st.card_writes[F32_CLASS_FAT] > 0);
+    munit_assert(st.card_writes[F32_CLASS_DIR] > 0);
+
+    uint32_t commands = 0;
+    for(int i = 0; i < F32_STATS_BUCKETS; i++) {
+        commands += st.latency[i];
+    }
+    munit_assert(commands == st.read_cmds + st.write_cmds);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+#endif
+
+static MunitResult
+test_reopen(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    // misses are remembered until the file is created
+    for(int i = 0; i < 3; i++) {
+        munit_assert_ptr_null(f32_open("REOPEN.TXT", "r"));
+    }
+
+    f32_file * fd = f32_open("REOPEN.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_write(fd, (const uint8_t*)"first\n", 6) == 0);
+    munit_assert(f32_close(fd) == 0);
+
+#if F32_STATS
+    f32_stats st;
+    munit_assert(f32_get_stats(NULL, 1) == 0);
+#endif
+    for(int i = 0; i < 3; i++) {
+        fd = f32_open("REOPEN.TXT", "a");
+        munit_assert_ptr_not_null(fd);
+        munit_assert(fd->size == 6 + 7*i);
+        munit_assert(f32_write(fd, (const uint8_t*)"append\n", 7) == 0);
+        munit_assert(f32_close(fd) == 0);
+    }
+#if F32_STATS && F32_NAME_CACHE
+    munit_assert(f32_get_stats(&st, 0) == 0);
+    munit_assert(st.reads[F32_CLASS_DIR] == 3); // the size updates only
+#endif
+
+    munit_assert(f32_umount() == 0);
+
+    munit_assert(f32_mount(&sec) == 0);
+    fd = f32_open("REOPEN.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 6 + 7*3);
+    munit_assert(f32_read(fd) == 6 + 7*3);
+    munit_assert_memory_equal(13, sec.data, "first\nappend\n");
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_nested_reopen(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    f32_file * fd = f32_open("/MYDIR~1/SECRETS/NESTED.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_write(fd, (const uint8_t*)"nested\n", 7) == 0);
+    munit_assert(f32_close(fd) == 0);
+
+    // the same directory, a parent and a sibling file
+    fd = f32_open("MYDIR~1/SECRETS/NESTED.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 7);
+    munit_assert(f32_close(fd) == 0);
+
+    fd = f32_open("/MYDIR~1/HAMLET.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->start_cluster == 0x1C);
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert_ptr_null(f32_open("/MYDIR~1/SECRETS/MISSING.TXT", "r"));
+    munit_assert_ptr_null(f32_open("/MYDIR~1/SECRET/NESTED.TXT", "r"));
+
+    // dot entries can be followed but never created, empty names not at all
+    fd = f32_open("/MYDIR~1/SECRETS/../HAMLET.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->start_cluster == 0x1C);
+    munit_assert(f32_close(fd) == 0);
+    munit_assert_ptr_null(f32_open("/.", "w"));
+    munit_assert_ptr_null(f32_open("/..", "a"));
+    munit_assert_ptr_null(f32_open("/MYDIR~1/", "w"));
+    munit_assert_ptr_null(f32_open("", "w"));
+
+    fd = f32_open("/MYDIR~1/SECRETS/NESTED.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_read(fd) == 7);
+    munit_assert_memory_equal(7, sec.data, "nested\n");
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+#if F32_LFN
+static MunitResult
+test_long_names(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    const char * names[3] = {
+        "/MYDIR~1/Daily log 2026-10-17.txt",
+        "/MYDIR~1/Daily log 2026-10-18.txt",
+        "/MYDIR~1/Thirteen.char", // exactly one long name entry
+    };
+    for(int n = 0; n < 3; n++) {
+        f32_file * fd = f32_open(names[n], "w");
+        munit_assert_ptr_not_null(fd);
+        munit_assert(f32_write(fd, (const uint8_t*)names[n], n + 1) == 0);
+        munit_assert(f32_close(fd) == 0);
+    }
+    munit_assert(f32_umount() == 0);
+
+    munit_assert(f32_mount(&sec) == 0);
+
+    // long names match in any case
+    f32_file * fd = f32_open("/MYDIR~1/daily LOG 2026-10-17.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 1);
+    munit_assert(f32_close(fd) == 0);
+
+    fd = f32_open("/MYDIR~1/Daily log 2026-10-18.txt", "a");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 2);
+    munit_assert(f32_close(fd) == 0);
+
+    fd = f32_open("/MYDIR~1/thirteen.char", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 3);
+    munit_assert(f32_close(fd) == 0);
+
+    // the generated short names
+    fd = f32_open("/MYDIR~1/DAILYL~1.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 1);
+    munit_assert(f32_close(fd) == 0);
+
+    fd = f32_open("/MYDIR~1/DAILYL~2.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 2);
+    munit_assert(f32_close(fd) == 0);
+
+    // written by another system
+    fd = f32_open("/My Directory/HAMLET.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(fd->size == 185977);
+    munit_assert(f32_close(fd) == 0);
+
+    munit_assert_ptr_null(f32_open("/MYDIR~1/Daily log 2026-10-1.txt", "r"));
+    munit_assert_ptr_null(f32_open("/MYDIR~1/Daily log 2026-10-177.txt", "r"));
+    munit_assert_ptr_null(f32_open("/MYDIR~1/Thirteen.chat", "r"));
+
+    // long names couldn't be found again with anything but ASCII
+    munit_assert_ptr_null(f32_open("/MYDIR~1/Caf\xC3\xA9 log.txt", "w"));
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+#endif
+
+/**
+ * Number n of a file named Fn.TXT with the given count of digits, or -1
+ * for any other name
+ */
+static int
+file_number(const char * name, int digits) {
+    if(strlen(name) != (size_t)digits + 5 || name[0] != 'F'
+            || strcmp(&name[1 + digits], ".TXT") != 0) {
+        return -1;
+    }
+
+    int n = 0;
+    for(int i = 1; i <= digits; i++) {
+        if(name[i] < '0' || name[i] > '9') {
+            return -1;
+        }
+        n = n*10 + name[i] - '0';
+    }
+    return n;
+}
+
+static MunitResult
+test_readdir(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    f32_dir dir;
+    f32_dirent en;
+    munit_assert(f32_mount(&sec) == 0);
+
+    munit_assert(f32_opendir(&dir, "/") == 0);
+    munit_assert(f32_readdir(&dir, &en) == 0);
+    munit_assert(en.attr & 0x08); // volume label
+    munit_assert(f32_readdir(&dir, &en) == 0);
+    munit_assert_string_equal(en.name, "TEST.TXT");
+    munit_assert(en.size == 20);
+    munit_assert(f32_readdir(&dir, &en) == 0);
+    munit_assert_string_equal(en.name, "HAMLET.TXT");
+    munit_assert(en.size == 185977);
+    munit_assert(f32_readdir(&dir, &en) == 0); // long name parts are skipped
+    munit_assert_string_equal(en.name, "MYDIR~1");
+    munit_assert(en.attr & 0x10);
+    // files written by earlier tests follow, then the end stays the end
+    while(f32_readdir(&dir, &en) == 0) {
+    }
+    munit_assert(f32_readdir(&dir, &en) == 1);
+
+    munit_assert(f32_opendir(&dir, "TEST.TXT") == 1);
+    munit_assert(f32_opendir(&dir, "/MYDIR~1/NOPE") == 1);
+
+    // enough files to span several directory sectors
+    char fname[32];
+    for(int i = 0; i < 40; i++) {
+        snprintf(fname, sizeof(fname), "/MYDIR~1/SECRETS/F%02d.TXT", i);
+        f32_file * fd = f32_open(fname, "w");
+        munit_assert_ptr_not_null(fd);
+        munit_assert(f32_close(fd) == 0);
+    }
+
+    munit_assert(f32_opendir(&dir, "/MYDIR~1/SECRETS/") == 0);
+#if F32_STATS
+    f32_stats st;
+    munit_assert(f32_get_stats(NULL, 1) == 0);
+#endif
+    int files = 0;
+    int entries = 0;
+    while(f32_readdir(&dir, &en) == 0) {
+        entries++;
+        if(file_number(en.name, 2) < 0) {
+            continue; // dot entries and files of other tests
+        }
+
+        munit_assert(file_number(en.name, 2) == files++);
+        munit_assert(en.size == 0);
+    }
+    munit_assert(files == 40);
+#if F32_STATS
+    // every short entry and the end marker, 16 to a sector
+    munit_assert(f32_get_stats(&st, 0) == 0);
+    munit_assert(st.reads[F32_CLASS_DIR] == (uint32_t)(entries + 16)/16);
+#else
+    (void)entries;
+#endif
+
+    // the shared buffer can be used between entries
+    munit_assert(f32_opendir(&dir, "MYDIR~1/SECRETS") == 0);
+    files = 0;
+    while(f32_readdir(&dir, &en) == 0) {
+        f32_file * fd = f32_open("TEST.TXT", "r");
+        munit_assert_ptr_not_null(fd);
+        munit_assert(f32_read(fd) == 20);
+        munit_assert(f32_close(fd) == 0);
+        if(file_number(en.name, 2) >= 0) {
+            files++;
+        }
+    }
+    munit_assert(files == 40);
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_dir_index(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    char fname[32];
+    for(int i = 0; i < 100; i++) {
+        snprintf(fname, sizeof(fname), "/MYDIR~1/SECRETS/F%03d.TXT", i);
+        f32_file * fd = f32_open(fname, "w");
+        munit_assert_ptr_not_null(fd);
+        munit_assert(f32_write(fd, (const uint8_t*)fname, strlen(fname)) == 0);
+        munit_assert(f32_close(fd) == 0);
+    }
+    munit_assert(f32_umount() == 0);
+
+    // the first lookup scans and leaves the directory indexed
+    munit_assert(f32_mount(&sec) == 0);
+    f32_file * fd = f32_open("/MYDIR~1/SECRETS/F099.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_close(fd) == 0);
+
+    // smaller indexes can't hold the directory and fall back to scanning
+#if F32_STATS && (F32_DIR_INDEX >= 1024)
+    f32_stats st;
+    munit_assert(f32_get_stats(NULL, 1) == 0);
+    fd = f32_open("/MYDIR~1/SECRETS/F098.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_get_stats(&st, 1) == 0);
+    munit_assert(st.reads[F32_CLASS_DIR] == 1);
+    munit_assert(f32_close(fd) == 0);
+
+    // a miss reads nothing, the create reads the sector of the free entry
+    munit_assert(f32_get_stats(NULL, 1) == 0);
+    fd = f32_open("/MYDIR~1/SECRETS/NEW.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_get_stats(&st, 1) == 0);
+    munit_assert(st.reads[F32_CLASS_DIR] <= 1);
+    munit_assert(f32_close(fd) == 0);
+#else
+    fd = f32_open("/MYDIR~1/SECRETS/NEW.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_close(fd) == 0);
+#endif
+    munit_assert_ptr_null(f32_open("/MYDIR~1/SECRETS/F100.TXT", "r"));
+
+    fd = f32_open("/MYDIR~1/SECRETS/NEW2.TXT", "w");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+
+    // everything is where the index put it
+    munit_assert(f32_mount(&sec) == 0);
+    for(int i = 0; i < 100; i++) {
+        snprintf(fname, sizeof(fname), "/MYDIR~1/SECRETS/F%03d.TXT", i);
+        fd = f32_open(fname, "r");
+        munit_assert_ptr_not_null(fd);
+        munit_assert(f32_read(fd) == strlen(fname));
+        munit_assert_memory_equal(strlen(fname), sec.data, fname);
+        munit_assert(f32_close(fd) == 0);
+    }
+
+    f32_dir dir;
+    f32_dirent en;
+    int files = 0;
+    int entries = 0;
+    munit_assert(f32_opendir(&dir, "/MYDIR~1/SECRETS") == 0);
+    while(f32_readdir(&dir, &en) == 0) {
+        entries++;
+        if(file_number(en.name, 3) >= 0 || strcmp(en.name, "NEW.TXT") == 0
+                || strcmp(en.name, "NEW2.TXT") == 0) {
+            files++;
+        }
+    }
+    munit_assert(files == 102);
+    fd = f32_open("/MYDIR~1/SECRETS/NEW2.TXT", "r");
+    munit_assert_ptr_not_null(fd);
+    munit_assert(f32_close(fd) == 0);
+
+#if F32_STATS
+    // a miss reads the directory at most once, even if it is too large for
+    // the index. Resolving the path costs at most a miss in MYDIR~1.
+    f32_stats dir_st;
+    munit_assert(f32_get_stats(NULL, 1) == 0);
+    munit_assert_ptr_null(f32_open("/MYDIR~1/NOPE.TXT", "r"));
+    munit_assert(f32_get_stats(&dir_st, 1) == 0);
+    uint32_t path_reads = dir_st.reads[F32_CLASS_DIR];
+    for(int i = 0; i < 2; i++) {
+        snprintf(fname, sizeof(fname), "/MYDIR~1/SECRETS/F%03d.TXT", 100 + i);
+        munit_assert_ptr_null(f32_open(fname, "r"));
+        munit_assert(f32_get_stats(&dir_st, 1) == 0);
+        munit_assert(dir_st.reads[F32_CLASS_DIR] <= path_reads + (uint32_t)(entries + 16)/16);
+    }
+#else
+    (void)entries;
+#endif
+
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_interleaved_appends(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    munit_assert(f32_mount(&sec) == 0);
+
+    const char * names[3] = {"CH0.TXT", "CH1.TXT", "CH2.TXT"};
+    f32_file * fd[3];
+    for(int n = 0; n < 3; n++) {
+        fd[n] = f32_open(names[n], "w");
+        munit_assert_ptr_not_null(fd[n]);
+    }
+
+    // log channels written in turn, the way the firmware does
+    char line[41];
+    uint32_t written = io_dev_stats.blocks_written;
+    for(int i = 0; i < 300; i++) {
+        for(int n = 0; n < 3; n++) {
+            snprintf(line, sizeof(line), "channel %d line %-24d\n", n, i);
+            munit_assert(f32_write(fd[n], (const uint8_t*)line, 40) == 0);
+        }
+    }
+#if F32_HANDLE_BUFFERS && !F32_CACHE_SECTORS
+    // one write per sector filled, plus the periodic entry syncs
+    munit_assert((io_dev_stats.blocks_written - written)*4 < 900);
+#else
+    (void)written;
+#endif
+
+    for(int n = 0; n < 3; n++) {
+        munit_assert(f32_close(fd[n]) == 0);
+    }
+    munit_assert(f32_umount() == 0);
+
+    munit_assert(f32_mount(&sec) == 0);
+    for(int n = 0; n < 3; n++) {
+        f32_file * rd = f32_open(names[n], "r");
+        munit_assert_ptr_not_null(rd);
+        munit_assert(rd->size == 300*40);
+
+        uint32_t offset = 0;
+        uint16_t br;
+        while((br = f32_read(rd)) != F32_EOF) {
+            for(uint16_t j = 0; j < br; j++, offset++) {
+                snprintf(line, sizeof(line), "channel %d line %-24d\n", n, (int)(offset/40));
+                munit_assert(sec.data[j] == line[offset % 40]);
+            }
+        }
+        munit_assert(offset == 300*40);
+        munit_assert(f32_close(rd) == 0);
+    }
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+
+#if F32_WRITE_BEHIND
+static MunitResult
+test_write_behind(const MunitParameter params[], void* data) {
+    (void) params;
+    (void) data;
+
+    f32_sector sec;
+    f32_wb_stats st;
+    munit_assert(f32_mount(&sec) == 0);
+    munit_assert(f32_get_wb_stats(NULL, 1) == 0);
+
+    f32_file * fd = f32_open("BEHIND.BIN", "w");
+    munit_assert_ptr_not_null(fd);
+    for(int i = 0; i < 64; i++) {
+        memset(sec.data, i, SEC_SIZE);
+        munit_assert(f32_write_sec(fd) == 0);
+        munit_assert(f32_poll() == 0);
+    }
+
+    munit_assert(f32_get_wb_stats(&st, 0) == 0);
+    munit_assert(st.queued > 0);
+    munit_assert(st.max_fill <= F32_WRITE_BEHIND);
+    munit_assert(st.dropped == 0);
+
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_get_wb_stats(&st, 0) == 0);
+    munit_assert(st.written == st.queued);
+    munit_assert(f32_umount() == 0);
+
+    munit_assert(f32_mount(&sec) == 0);
+    fd = f32_open("BEHIND.BIN", "r");
+    munit_assert_ptr_not_null(fd);
+    for(int i = 0; i < 64; i++) {
+        munit_assert(f32_read(fd) == SEC_SIZE);
+        for(int j = 0; j < SEC_SIZE; j++) {
+            munit_assert(sec.data[j] == i);
+        }
+    }
+    munit_assert(f32_close(fd) == 0);
+    munit_assert(f32_umount() == 0);
+    return MUNIT_OK;
+}
+#endif
+
 /** Test file that is exactly aligned with cluster boundary */
 
 static MunitTest test_suite_tests[] = {
@@ -375,6 +1327,29 @@ static MunitTest test_suite_tests[] = {
     { (char*) "Seek Hamlet in directory", test_seek_hamlet_in_dir_txt, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { (char*) "Write Hamlet", test_write_hamlet, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { (char*) "Write Hamlet in root", test_write_hamlet_root, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Write and remount", test_write_remount, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Bulk write", test_write_bulk, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Small appends", test_write_small_appends, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Interleaved appends", test_interleaved_appends, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Reopen", test_reopen, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Reopen nested path", test_nested_reopen, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#if F32_LFN
+    { (char*) "Long file names", test_long_names, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#endif
+    { (char*) "Read directory", test_readdir, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Directory index", test_dir_index, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Deferred sync", test_deferred_sync, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Seek fragmented file", test_seek_fragmented, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Preallocate", test_prealloc, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Custom device", test_custom_device, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "Memory mapped image", test_mmap_device, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { (char*) "RAM disk", test_ram_device, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#if F32_STATS
+    { (char*) "I/O statistics", test_stats, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#endif
+#if F32_WRITE_BEHIND
+    { (char*) "Write-behind queue", test_write_behind, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#endif
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
 
@@ -0,0 +1,545 @@
+#include "f32.h"
+#include "f32_access.h"
+#include "sdcard.h"
+#include "spi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * SD card emulator for the host build. spi_transfer is answered by a card
+ * state machine backed by an image held in memory, so sdcard.c runs
+ * unmodified on Linux. Every byte clocked over the bus is counted, which
+ * shows how much of each operation is protocol overhead: dummy polls
+ * while waiting on the card, command framing and chip select toggles.
+ *
+ * gcc -DDESKTOP -DF32_NO_RTC=1 -Isrc -o sd_emu tests/sd_emu.c src/sdcard.c src/f32*.c
+ * ./sd_emu [image]
+ *
+ * The image defaults to test_mmc.img and is never written. Each workload
+ * prints one JSON line.
+ */
+
+#define EMU_QUEUE_SIZE      (4 + 1 + SEC_SIZE + 2)
+#define EMU_F_CPU           16000000UL /* clock of the emulated AVR */
+
+/**
+ * Card timing, in bytes clocked over the bus
+ */
+typedef struct {
+    uint16_t ncr; /* filler before a command response */
+    uint16_t read_delay; /* filler before a data start token */
+    uint16_t write_busy; /* busy bytes after each block is programmed */
+    uint16_t init_polls; /* ACMD41 attempts before the card is ready */
+} sd_emu_config;
+
+typedef struct {
+    uint32_t bytes; /* bytes clocked */
+    uint32_t polls; /* 0xFF sent while the card had nothing to say or was busy */
+    uint32_t cs_toggles;
+    uint32_t commands;
+    uint32_t blocks; /* data blocks moved in either direction */
+    uint64_t bus_ns; /* time the bytes take at the selected SPI clock */
+} sd_emu_stats;
+
+enum {
+    EMU_CMD, /* waiting for a command */
+    EMU_READ_MULTI, /* streaming blocks until CMD12 */
+    EMU_WRITE_TOKEN, /* waiting for the start token of a single block write */
+    EMU_WRITE_MULTI_TOKEN, /* waiting for a multi-block start or stop token */
+    EMU_WRITE_DATA, /* receiving a block and its CRC */
+};
+
+volatile uint8_t DDRB;
+volatile uint8_t PORTB = 0xFF;
+
+static sd_emu_config cfg = { .ncr = 1, .read_delay = 8, .write_busy = 40, .init_polls = 3 };
+static sd_emu_stats st;
+
+static uint8_t * image;
+static uint32_t image_sectors;
+
+static uint8_t mode = EMU_CMD;
+static uint8_t idle = 1;
+static uint8_t app_cmd;
+static uint16_t op_cond_polls;
+static uint8_t cs_was_low;
+static uint32_t byte_ns = 8000000000ULL/(EMU_F_CPU/128);
+
+static uint8_t cmd[6];
+static uint8_t cmd_len;
+
+static uint8_t queue[EMU_QUEUE_SIZE]; /* response bytes waiting to go out */
+static uint16_t queue_len;
+static uint16_t queue_pos;
+static uint16_t delay; /* 0xFF filler sent before the queue */
+static uint16_t busy; /* 0x00 sent once the queue is empty */
+static uint16_t busy_after; /* busy that starts when the queue empties */
+
+static uint32_t addr; /* next block to read or write */
+static uint8_t read_pending; /* a block goes out once the queue is empty */
+static uint8_t queue_is_block; /* the queue holds a data block */
+static uint16_t recv_len;
+static uint8_t recv[SEC_SIZE + 2];
+static uint8_t multi_write;
+
+void _delay_ms(double ms) {
+    (void)ms;
+}
+
+void spi_init(void) {
+    byte_ns = 8000000000ULL/(EMU_F_CPU/128);
+}
+
+void spi_read_block(uint8_t *buf, uint16_t len) {
+    while(len--) *buf++ = spi_transfer(0xFF);
+}
+
+void spi_write_block(const uint8_t *buf, uint16_t len) {
+    while(len--) spi_transfer(*buf++);
+}
+
+uint32_t spi_set_speed(uint32_t max_hz) {
+    // same dividers as the AVR, fosc/2 to fosc/128
+    uint8_t shift = 1;
+    while((shift < 7) && ((EMU_F_CPU >> shift) > max_hz)) {
+        shift++;
+    }
+
+    byte_ns = 8000000000ULL/(EMU_F_CPU >> shift);
+    return EMU_F_CPU >> shift;
+}
+
+static void emu_queue_clear(void) {
+    queue_is_block = 0;
+    queue_len = 0;
+    queue_pos = 0;
+    delay = 0;
+    busy = 0;
+    busy_after = 0;
+}
+
+static void emu_respond(uint8_t r1) {
+    emu_queue_clear();
+    delay = cfg.ncr;
+    queue[queue_len++] = r1 | idle;
+}
+
+static void emu_queue_block(const uint8_t * data, uint16_t len) {
+    queue[queue_len++] = 0xFE;
+    memcpy(&queue[queue_len], data, len);
+    queue_len += len;
+
+    // CRC is not checked by the driver
+    queue[queue_len++] = 0xFF;
+    queue[queue_len++] = 0xFF;
+}
+
+/**
+ * Queue the next block of a read after the R1 (or the previous block)
+ */
+static void emu_queue_read(void) {
+    queue_len = 0;
+    queue_pos = 0;
+
+    // the byte that noticed the empty queue was the first filler byte
+    delay = cfg.read_delay ? cfg.read_delay - 1 : 0;
+
+    if(addr >= image_sectors) {
+        queue[queue_len++] = 0x08; /* out of range error token */
+        read_pending = 0;
+        mode = EMU_CMD;
+        return;
+    }
+
+    emu_queue_block(&image[(size_t)addr*SEC_SIZE], SEC_SIZE);
+    queue_is_block = 1;
+    addr++;
+    read_pending = (mode == EMU_READ_MULTI);
+}
+
+static void emu_csd(uint8_t * csd) {
+    // CSD version 2.0, 25 MHz, capacity in 512 KiB units
+    uint32_t c_size = image_sectors/1024 - 1;
+    memset(csd, 0, 16);
+    csd[0] = 0x40;
+    csd[1] = 0x0E;
+    csd[3] = 0x32;
+    csd[4] = 0x5B;
+    csd[5] = 0x59;
+    csd[7] = (c_size >> 16) & 0x3F;
+    csd[8] = c_size >> 8;
+    csd[9] = c_size;
+    csd[10] = 0x7F;
+    csd[11] = 0x80;
+    csd[12] = 0x0A;
+    csd[13] = 0x40;
+    csd[15] = 0x01;
+}
+
+static void emu_command(void) {
+    uint8_t index = cmd[0] & 0x3F;
+    uint32_t arg = ((uint32_t)cmd[1] << 24) | ((uint32_t)cmd[2] << 16) | ((uint32_t)cmd[3] << 8) | cmd[4];
+    uint8_t app = app_cmd;
+    app_cmd = 0;
+    st.commands++;
+
+    if(app) {
+        switch(index) {
+            case 41:
+                if(++op_cond_polls > cfg.init_polls) {
+                    idle = 0;
+                }
+                emu_respond(0x00);
+                return;
+            case 23:
+                emu_respond(0x00);
+                return;
+        }
+    }
+
+    switch(index) {
+        case 0:
+            idle = 1;
+            op_cond_polls = 0;
+            mode = EMU_CMD;
+            emu_respond(0x00);
+            break;
+        case 8:
+            emu_respond(0x00);
+            queue[queue_len++] = 0x00;
+            queue[queue_len++] = 0x00;
+            queue[queue_len++] = 0x01;
+            queue[queue_len++] = arg & 0xFF;
+            break;
+        case 9: {
+            uint8_t csd[16];
+            emu_csd(csd);
+            emu_respond(0x00);
+            emu_queue_block(csd, sizeof(csd));
+            break;
+        }
+        case 12:
+            // the byte after CMD12 is a stuff byte
+            mode = EMU_CMD;
+            read_pending = 0;
+            emu_respond(0x00);
+            delay++;
+            break;
+        case 55:
+            app_cmd = 1;
+            emu_respond(0x00);
+            break;
+        case 58:
+            emu_respond(0x00);
+            queue[queue_len++] = 0xC0;
+            queue[queue_len++] = 0xFF;
+            queue[queue_len++] = 0x80;
+            queue[queue_len++] = 0x00;
+            break;
+        case 17:
+        case 18:
+            if(idle || (arg >= image_sectors)) {
+                emu_respond(idle ? 0x04 : 0x40);
+                break;
+            }
+            // the data follows once the R1 is out
+            emu_respond(0x00);
+            addr = arg;
+            read_pending = 1;
+            mode = (index == 18) ? EMU_READ_MULTI : EMU_CMD;
+            break;
+        case 24:
+        case 25:
+            if(idle || (arg >= image_sectors)) {
+                emu_respond(idle ? 0x04 : 0x40);
+                break;
+            }
+            emu_respond(0x00);
+            addr = arg;
+            multi_write = (index == 25);
+            mode = multi_write ? EMU_WRITE_MULTI_TOKEN : EMU_WRITE_TOKEN;
+            break;
+        default:
+            emu_respond(0x04);
+            break;
+    }
+}
+
+static void emu_receive(uint8_t mosi) {
+    recv[recv_len++] = mosi;
+    if(recv_len < sizeof(recv)) {
+        return;
+    }
+
+    if(addr < image_sectors) {
+        memcpy(&image[(size_t)addr*SEC_SIZE], recv, SEC_SIZE);
+        addr++;
+        st.blocks++;
+        queue[queue_len++] = 0xE5; /* data accepted */
+    } else {
+        queue[queue_len++] = 0xED; /* write error */
+    }
+
+    busy_after = cfg.write_busy;
+    mode = multi_write ? EMU_WRITE_MULTI_TOKEN : EMU_CMD;
+}
+
+uint8_t spi_transfer(uint8_t mosi) {
+    uint8_t cs_low = !(PORTB & (1 << PINB2));
+    if(cs_low != cs_was_low) {
+        st.cs_toggles++;
+        cs_was_low = cs_low;
+    }
+
+    st.bytes++;
+    st.bus_ns += byte_ns;
+
+    if(!cs_low) {
+        // programming carries on while the card is deselected
+        if((queue_pos == queue_len) && busy) {
+            busy--;
+        }
+
+        cmd_len = 0;
+        if(mosi == 0xFF) {
+            st.polls++;
+        }
+        return 0xFF;
+    }
+
+    // what the card clocks out was decided before it sees this byte
+    uint8_t miso;
+    uint8_t informative = 1;
+    if(delay) {
+        delay--;
+        miso = 0xFF;
+        informative = 0;
+    } else if(queue_pos < queue_len) {
+        miso = queue[queue_pos++];
+        if(queue_pos == queue_len) {
+            // blocks cut short by CMD12 don't count
+            st.blocks += queue_is_block;
+            queue_is_block = 0;
+            queue_pos = queue_len = 0;
+            busy = busy_after;
+            busy_after = 0;
+        }
+    } else if(busy) {
+        busy--;
+        miso = 0x00;
+        informative = 0;
+    } else {
+        miso = 0xFF;
+        informative = 0;
+        if(read_pending) {
+            emu_queue_read();
+        }
+    }
+
+    if((mosi == 0xFF) && !informative) {
+        st.polls++;
+    }
+
+    switch(mode) {
+        case EMU_WRITE_TOKEN:
+            if(mosi == 0xFE) {
+                recv_len = 0;
+                mode = EMU_WRITE_DATA;
+            }
+            return miso;
+        case EMU_WRITE_MULTI_TOKEN:
+            if(mosi == 0xFC) {
+                recv_len = 0;
+                mode = EMU_WRITE_DATA;
+            } else if(mosi == 0xFD) {
+                // one byte after the stop token, then busy
+                mode = EMU_CMD;
+                emu_queue_clear();
+                delay = 1;
+                busy_after = cfg.write_busy;
+                queue[queue_len++] = 0xFF;
+            }
+            return miso;
+        case EMU_WRITE_DATA:
+            emu_receive(mosi);
+            return miso;
+    }
+
+    // commands start with 01 in the top bits, even in the middle of a read
+    if((cmd_len == 0) && ((mosi & 0xC0) != 0x40)) {
+        return miso;
+    }
+
+    cmd[cmd_len++] = mosi;
+    if(cmd_len == sizeof(cmd)) {
+        cmd_len = 0;
+        emu_command();
+    }
+
+    return miso;
+}
+
+static uint8_t emu_load(const char * path) {
+    FILE * img = fopen(path, "rb");
+    if(img == NULL) {
+        return 1;
+    }
+
+    fseek(img, 0, SEEK_END);
+    image_sectors = ftell(img)/SEC_SIZE;
+    fseek(img, 0, SEEK_SET);
+
+    image = malloc((size_t)image_sectors*SEC_SIZE);
+    uint8_t res = (image == NULL) || (fread(image, SEC_SIZE, image_sectors, img) != image_sectors);
+    fclose(img);
+    return res;
+}
+
+/**
+ * The real driver behind the block device interface
+ */
+static const io_device emu_device = {
+    .init = sd_init,
+    .read_block = sd_read_block,
+    .write_block = sd_write_block,
+    .read_blocks = sd_read_blocks,
+    .write_blocks = sd_write_blocks,
+    .sync = sd_sync,
+    .poll = sd_poll,
+    .sector_count = sd_sector_count,
+    .stream_start = sd_stream_start,
+    .stream_read = sd_stream_read,
+    .stream_stop = sd_stream_stop,
+};
+
+static f32_sector sec;
+static sd_emu_stats start;
+
+static void report_start(void) {
+    start = st;
+}
+
+static void report(const char * name) {
+    uint32_t bytes = st.bytes - start.bytes;
+    uint32_t blocks = st.blocks - start.blocks;
+    uint32_t payload = blocks*SEC_SIZE;
+
+    printf("{\"op\": \"%s\", \"blocks\": %u, \"spi_bytes\": %u, \"bytes_per_block\": %.1f, "
+           "\"overhead\": %.4f, \"polls\": %u, \"cs_toggles\": %u, \"commands\": %u, \"bus_ms\": %.3f}\n",
+        name, blocks, bytes, blocks ? (double)bytes/blocks : 0.0,
+        bytes ? ((double)bytes - payload)/bytes : 0.0,
+        st.polls - start.polls, st.cs_toggles - start.cs_toggles, st.commands - start.commands,
+        (st.bus_ns - start.bus_ns)*1e-6);
+    fflush(stdout);
+}
+
+static void fail(const char * what) {
+    fprintf(stderr, "sd_emu: %s\n", what);
+    exit(1);
+}
+
+int main(int argc, char * argv[]) {
+    if(emu_load((argc > 1) ? argv[1] : "test_mmc.img")) {
+        fail("cannot load image");
+    }
+
+    report_start();
+    if(f32_mount_dev(&emu_device, &sec)) {
+        fail("mount failed");
+    }
+    report("mount");
+
+    if(sd_sector_count() != image_sectors) {
+        fail("capacity from the CSD doesn't match the image");
+    }
+
+    // read a file through the driver and check it against the original
+    FILE * act = fopen("tests/hamlet.txt", "r");
+    if(act == NULL) {
+        fail("cannot open tests/hamlet.txt");
+    }
+
+    report_start();
+    f32_file * fd = f32_open("HAMLET.TXT", "r");
+    if(fd == NULL) {
+        fail("cannot open HAMLET.TXT");
+    }
+    uint8_t buf[SEC_SIZE];
+    uint16_t br;
+    while((br = f32_read(fd)) != F32_EOF) {
+        if((fread(buf, br, 1, act) != 1) || memcmp(buf, sec.data, br)) {
+            fail("HAMLET.TXT differs");
+        }
+    }
+    f32_close(fd);
+    report("read_hamlet");
+
+    // whole sectors in large writes
+    report_start();
+    fd = f32_open("EMU.BIN", "w");
+    static uint8_t chunk[8*SEC_SIZE];
+    fseek(act, 0, SEEK_SET);
+    for(int i = 0; i < 16; i++) {
+        if((fread(chunk, sizeof(chunk), 1, act) != 1) || f32_write(fd, chunk, sizeof(chunk))) {
+            fail("write EMU.BIN failed");
+        }
+    }
+    if(f32_close(fd)) {
+        fail("close EMU.BIN failed");
+    }
+    report("write_bulk");
+
+    // short log lines
+    report_start();
+    fd = f32_open("EMU.TXT", "a");
+    for(int i = 0; i < 500; i++) {
+        if(f32_write(fd, (const uint8_t*)"[2020/02/25 12:00:00] Hello World!\n", 35)) {
+            fail("append failed");
+        }
+    }
+    if(f32_close(fd)) {
+        fail("close EMU.TXT failed");
+    }
+    report("small_appends");
+
+    // a raw write returns before programming ends, sd_poll sees it finish
+    report_start();
+    if(sd_read_block(image_sectors - 1, buf) || sd_write_block(image_sectors - 1, buf)) {
+        fail("raw write failed");
+    }
+#if SD_DEFER_BUSY
+    if(!sd_poll()) {
+        fail("write did not leave the card busy");
+    }
+#endif
+    while(sd_poll()) {
+    }
+    report("deferred_busy");
+
+    report_start();
+    if(f32_umount()) {
+        fail("umount failed");
+    }
+    report("umount");
+
+    // everything written must read back after a fresh mount
+    if(f32_mount_dev(&emu_device, &sec)) {
+        fail("remount failed");
+    }
+    fd = f32_open("EMU.BIN", "r");
+    if((fd == NULL) || (fd->size != 16*sizeof(chunk))) {
+        fail("EMU.BIN missing after remount");
+    }
+    fseek(act, 0, SEEK_SET);
+    while((br = f32_read(fd)) != F32_EOF) {
+        if((fread(buf, br, 1, act) != 1) || memcmp(buf, sec.data, br)) {
+            fail("EMU.BIN differs");
+        }
+    }
+    f32_close(fd);
+    f32_umount();
+
+    fclose(act);
+    return 0;
+}